@@ -0,0 +1,272 @@
+/*
+ * Standalone benchmark of use_encryption work connections: throughput of
+ * a socketpair carried by two bufferevents, in plain, with the sender
+ * sealing in place over the evbuffer chains (xfrpc's share, frps would
+ * open on its own box) and with both ends on this cpu; plus the cipher
+ * alone in place against the allocating encrypt_data(), and each
+ * work_cipher sealing and opening in place. Ends with the seal cost
+ * against the under 10% goal, and in cpu at a 500 Mbit/s link.
+ *
+ * gcc -O2 --std=gnu99 -o benchcrypto benchcrypto.c crypto.c debug.c \
+ *     fastpbkdf2.c -levent -lcrypto -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "crypto.h"
+#include "config.h"
+#include "debug.h"
+
+#define	BENCH_BYTES		(512*1024*1024)
+#define	BENCH_CHUNK		(64*1024)	// one local read
+#define	BENCH_LOWAT		(256*1024)	// refill the sender below this
+#define	GOAL_SLOWER		10			// percent the seal may cost over plain
+#define	LINK_MBPS		62.5		// a 500 Mbit/s tunnel
+
+static struct common_conf conf;
+
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+struct pipe_bench {
+	struct event_base		*base;
+	struct crypto_stream	*enc;	// NULL: plain
+	struct crypto_stream	*dec;
+	struct evbuffer			*src;
+	struct evbuffer			*plain;
+	size_t					sent;
+	size_t					received;
+	size_t					expect;		// bytes the receiver ends with
+	uint8_t					chunk[BENCH_CHUNK];
+};
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the local service produced a chunk, it goes to frps
+static void
+sender_cb(struct bufferevent *bev, void *arg)
+{
+	struct pipe_bench *pb = arg;
+	struct evbuffer *out = bufferevent_get_output(bev);
+	while (pb->sent < BENCH_BYTES && evbuffer_get_length(out) < 2 * BENCH_LOWAT) {
+		evbuffer_add(pb->src, pb->chunk, BENCH_CHUNK);
+		if (pb->enc)
+			crypto_stream_seal(pb->enc, pb->src, BENCH_CHUNK, out);
+		else
+			evbuffer_remove_buffer(pb->src, out, BENCH_CHUNK);
+		pb->sent += BENCH_CHUNK;
+	}
+}
+
+static void
+receiver_cb(struct bufferevent *bev, void *arg)
+{
+	struct pipe_bench *pb = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(in);
+	if (pb->dec) {
+		int r = crypto_stream_open(pb->dec, in, len, pb->plain);
+		assert(r == 0);
+		len = evbuffer_get_length(pb->plain);
+		evbuffer_drain(pb->plain, len);
+	} else {
+		evbuffer_drain(in, len);
+	}
+
+	pb->received += len;
+	if (pb->received >= pb->expect)
+		event_base_loopbreak(pb->base);
+}
+
+enum pipe_mode {
+	PIPE_PLAIN,
+	PIPE_SEAL,		// receiver takes the ciphertext as is
+	PIPE_SEAL_OPEN,
+};
+
+static double
+bench_pipe(struct event_base *base, enum pipe_mode mode)
+{
+	struct pipe_bench *pb = calloc(1, sizeof(struct pipe_bench));
+	assert(pb);
+	int fds[2];
+	int r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(r == 0);
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	pb->base = base;
+	pb->expect = BENCH_BYTES;
+	pb->src = evbuffer_new();
+	pb->plain = evbuffer_new();
+	for (int i = 0; i < BENCH_CHUNK; i++)
+		pb->chunk[i] = i % 251;
+
+	struct bufferevent *w = bufferevent_socket_new(base, fds[0], BEV_OPT_CLOSE_ON_FREE);
+	struct bufferevent *rd = bufferevent_socket_new(base, fds[1], BEV_OPT_CLOSE_ON_FREE);
+	assert(w && rd);
+	bufferevent_setcb(w, NULL, sender_cb, NULL, pb);
+	bufferevent_setwatermark(w, EV_WRITE, BENCH_LOWAT, 0);
+	bufferevent_setcb(rd, receiver_cb, NULL, NULL, pb);
+	bufferevent_enable(rd, EV_READ);
+	if (mode != PIPE_PLAIN) {
+		pb->enc = new_crypto_stream("bench", 1);
+		bufferevent_write(w, pb->enc->iv, pb->enc->iv_len);
+		if (mode == PIPE_SEAL)
+			pb->expect += pb->enc->iv_len;
+	}
+	if (mode == PIPE_SEAL_OPEN)
+		pb->dec = new_crypto_stream("bench", 0);
+
+	double start = now();
+	sender_cb(w, pb);
+	event_base_dispatch(base);
+	double elapsed = now() - start;
+	assert(pb->received == pb->expect);
+
+	bufferevent_free(w);
+	bufferevent_free(rd);
+	free_crypto_stream(pb->enc);
+	free_crypto_stream(pb->dec);
+	evbuffer_free(pb->src);
+	evbuffer_free(pb->plain);
+	free(pb);
+
+	return BENCH_BYTES / elapsed / (1024 * 1024);
+}
+
+// the cipher alone: in place over evbuffer chains, then through the
+// calloc-per-call encrypt_data() that was all there was before; returns
+// the in place MB/s
+static double
+bench_cipher_only()
+{
+	static uint8_t chunk[BENCH_CHUNK];
+	struct crypto_stream *cs = new_crypto_stream("bench", 1);
+	struct evbuffer *src = evbuffer_new(), *dst = evbuffer_new();
+
+	double start = now();
+	for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+		evbuffer_add(src, chunk, BENCH_CHUNK);
+		crypto_stream_seal(cs, src, BENCH_CHUNK, dst);
+		evbuffer_drain(dst, BENCH_CHUNK);
+	}
+	double inplace = BENCH_BYTES / (now() - start) / (1024 * 1024);
+
+	struct frp_coder *coder = new_coder("bench", "frp");
+	start = now();
+	for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+		uint8_t *out = NULL;
+		evbuffer_add(src, chunk, BENCH_CHUNK);
+		evbuffer_remove(src, chunk, BENCH_CHUNK);
+		encrypt_data(chunk, BENCH_CHUNK, coder, &out);
+		evbuffer_add(dst, out, BENCH_CHUNK);
+		free(out);
+		evbuffer_drain(dst, BENCH_CHUNK);
+	}
+	double alloc = BENCH_BYTES / (now() - start) / (1024 * 1024);
+
+	printf("cipher in place          %8.1f MB/s\n", inplace);
+	printf("cipher encrypt_data()    %8.1f MB/s\n", alloc);
+
+	free_encoder(coder);
+	free_crypto_stream(cs);
+	evbuffer_free(src);
+	evbuffer_free(dst);
+	return inplace;
+}
+
+// each work_cipher in place, records and tags included. Nothing picks
+// the fastest: stock frps only speaks aes-128-cfb, so the others are for
+// a patched frps set up to match
+static void
+bench_each_cipher()
+{
+	static const char *names[] = {"aes-128-cfb", "aes-128-gcm", "chacha20-poly1305"};
+	static uint8_t chunk[BENCH_CHUNK];
+	const char *fastest = NULL;
+	double best = 0;
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (set_work_cipher(names[i]) < 0)
+			continue;
+		struct crypto_stream *enc = new_crypto_stream("bench", 1);
+		struct crypto_stream *dec = new_crypto_stream("bench", 0);
+		struct evbuffer *src = evbuffer_new(), *wire = evbuffer_new(), *out = evbuffer_new();
+		evbuffer_add(wire, enc->iv, enc->iv_len);
+		crypto_stream_open(dec, wire, enc->iv_len, out);
+
+		double seal = 0, open = 0;
+		for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+			evbuffer_add(src, chunk, BENCH_CHUNK);
+			double t = now();
+			crypto_stream_seal(enc, src, BENCH_CHUNK, wire);
+			seal += now() - t;
+			t = now();
+			int r = crypto_stream_open(dec, wire, evbuffer_get_length(wire), out);
+			open += now() - t;
+			assert(r == 0);
+			evbuffer_drain(out, evbuffer_get_length(out));
+		}
+		seal = BENCH_BYTES / seal / (1024 * 1024);
+		open = BENCH_BYTES / open / (1024 * 1024);
+		printf("%-24s %8.1f MB/s seal %8.1f MB/s open\n", names[i], seal, open);
+		if (seal + open > best) {
+			best = seal + open;
+			fastest = names[i];
+		}
+
+		free_crypto_stream(enc);
+		free_crypto_stream(dec);
+		evbuffer_free(src);
+		evbuffer_free(wire);
+		evbuffer_free(out);
+	}
+	set_work_cipher(NULL);
+	if (fastest)
+		printf("fastest on this cpu: %s\n", fastest);
+}
+
+int main(void)
+{
+	debugconf.debuglevel = LOG_ERR;
+	struct event_base *base = event_base_new();
+	assert(base);
+
+	double plain = bench_pipe(base, PIPE_PLAIN);
+	double seal = bench_pipe(base, PIPE_SEAL);
+	double both = bench_pipe(base, PIPE_SEAL_OPEN);
+	printf("socketpair plain         %8.1f MB/s\n", plain);
+	printf("socketpair seal          %8.1f MB/s  %.1f%% slower\n", seal, 100 * (1 - seal / plain));
+	printf("socketpair seal+open     %8.1f MB/s  %.1f%% slower\n", both, 100 * (1 - both / plain));
+	double cipher = bench_cipher_only();
+	bench_each_cipher();
+
+	// when the cpu is the limit the seal can not beat the cipher alone;
+	// on a slower link it costs a share of one core instead
+	double slower = 100 * (1 - seal / plain);
+	printf("seal goal under %d%% slower: %s (%.1f%%), bound by the cipher at %.1f MB/s\n",
+			GOAL_SLOWER, slower < GOAL_SLOWER ? "met" : "not met", slower, cipher);
+	printf("seal at %.1f MB/s link     %8.1f%% of one core\n", LINK_MBPS, 100 * LINK_MBPS / cipher);
+
+	event_base_free(base);
+	return 0;
+}
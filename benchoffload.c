@@ -0,0 +1,167 @@
+/*
+ * Standalone benchmark of the crypto_threads offload: several work
+ * connections push 64KB local reads through crypto_stream_forward() at
+ * once, as tmux_read() and the proxy read callbacks do, and the sealed
+ * bytes are counted as the loop hands them to each connection's output.
+ * Run inline (crypto_threads = 0) and on 1..max worker threads.
+ *
+ * gcc -O2 --std=gnu99 -o benchoffload benchoffload.c crypto.c debug.c \
+ *     fastpbkdf2.c -levent -lcrypto -lpthread
+ * ./benchoffload [max threads] [work_cipher]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "crypto.h"
+#include "config.h"
+#include "debug.h"
+
+#define	BENCH_BYTES		(256*1024*1024)	// over all connections
+#define	BENCH_CHUNK		(64*1024)		// one local read
+#define	BENCH_CONNS		8
+#define	BENCH_QUEUED	4				// chunks a connection may have in flight
+
+static struct common_conf conf;
+
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+struct conn {
+	struct crypto_stream	*cs;
+	struct evbuffer			*src;
+	struct bufferevent		*dst;	// stands in for the frps side
+	size_t					sent;
+	size_t					received;
+};
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a socket bufferevent without an fd, its output unfrozen so jobs can
+// finish into it
+static struct bufferevent *
+new_dst(struct event_base *base)
+{
+	struct bufferevent *bev = bufferevent_socket_new(base, -1, 0);
+	assert(bev);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+	return bev;
+}
+
+// what reached the outputs leaves, as if written to frps
+static size_t
+collect(struct conn *c)
+{
+	size_t done = 0;
+	for (int i = 0; i < BENCH_CONNS; i++) {
+		struct evbuffer *out = bufferevent_get_output(c[i].dst);
+		size_t len = evbuffer_get_length(out);
+		evbuffer_drain(out, len);
+		c[i].received += len;
+		done += c[i].received;
+	}
+	return done;
+}
+
+static double
+bench_offload(struct event_base *base, int threads, const uint8_t *chunk)
+{
+	struct conn c[BENCH_CONNS];
+	const size_t per_conn = BENCH_BYTES / BENCH_CONNS;
+
+	crypto_offload_init(base, threads);
+	memset(c, 0, sizeof(c));
+	for (int i = 0; i < BENCH_CONNS; i++) {
+		c[i].cs = new_crypto_stream("bench", 1);
+		c[i].src = evbuffer_new();
+		c[i].dst = new_dst(base);
+	}
+
+	// aes-128-cfb output is as long as its input, aead adds record
+	// framing: count the plaintext and wait for every job instead
+	double start = now();
+	size_t sent = 0;
+	for (;;) {
+		for (int i = 0; i < BENCH_CONNS; i++) {
+			struct conn *cn = &c[i];
+			while (cn->sent < per_conn && cn->cs->inflight < BENCH_QUEUED) {
+				evbuffer_add(cn->src, chunk, BENCH_CHUNK);
+				int r = crypto_stream_forward(cn->cs, cn->src, BENCH_CHUNK, cn->dst, NULL, NULL);
+				assert(r == 0);
+				cn->sent += BENCH_CHUNK;
+				sent += BENCH_CHUNK;
+				if (!threads)
+					break;	// inline: one read per connection per loop pass
+			}
+		}
+
+		int inflight = 0;
+		for (int i = 0; i < BENCH_CONNS; i++)
+			inflight += c[i].cs->inflight;
+		if (sent == BENCH_BYTES && !inflight)
+			break;
+		if (inflight)
+			event_base_loop(base, EVLOOP_ONCE);
+		collect(c);
+	}
+	double elapsed = now() - start;
+	size_t wire = collect(c);
+	assert(wire >= BENCH_BYTES);
+
+	for (int i = 0; i < BENCH_CONNS; i++) {
+		free_crypto_stream(c[i].cs);
+		evbuffer_free(c[i].src);
+		bufferevent_free(c[i].dst);
+	}
+	crypto_offload_free();
+
+	return BENCH_BYTES / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t chunk[BENCH_CHUNK];
+	int max = argc > 1 ? atoi(argv[1]) : 4;
+	if (max > CRYPTO_MAX_THREADS)
+		max = CRYPTO_MAX_THREADS;
+
+	debugconf.debuglevel = LOG_ERR;
+	if (argc > 2 && set_work_cipher(argv[2]) < 0) {
+		printf("unknown cipher %s\n", argv[2]);
+		return 1;
+	}
+	struct event_base *base = event_base_new();
+	assert(base);
+	for (int i = 0; i < BENCH_CHUNK; i++)
+		chunk[i] = i % 251;
+
+	printf("%d connections, %d MB sealed in %d KB reads\n",
+			BENCH_CONNS, BENCH_BYTES / (1024 * 1024), BENCH_CHUNK / 1024);
+	double inline_mbps = bench_offload(base, 0, chunk);
+	printf("inline                   %8.1f MB/s\n", inline_mbps);
+	for (int n = 1; n <= max; n++) {
+		double mbps = bench_offload(base, n, chunk);
+		printf("%2d worker threads        %8.1f MB/s  %.2fx\n", n, mbps, mbps / inline_mbps);
+	}
+
+	free_key_cache();
+	event_base_free(base);
+	return 0;
+}
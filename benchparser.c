@@ -0,0 +1,168 @@
+/*
+ * Standalone benchmark of the tcp mux receive parser: a stream of DATA
+ * frames for a work connection, cut into reads that do not line up with
+ * the frames, goes through handle_tcp_mux_input() into the local
+ * service's output; control stream messages go to the message handler.
+ * Reports payload MB/s and frames per second for a few frame sizes.
+ *
+ * gcc -O2 --std=gnu99 -o benchparser benchparser.c tcpmux.c debug.c \
+ *     utils.c crypto.c fastpbkdf2.c -levent -lcrypto -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "tcpmux.h"
+#include "client.h"
+#include "config.h"
+#include "debug.h"
+
+#define	CTL_ID		1
+#define	WORK_ID		3
+#define	WIRE_BYTES	(1024*1024)		// one pass of frames, fed again and again
+#define	BENCH_BYTES	(512*1024*1024)	// payload per run
+
+static struct common_conf conf;
+static struct event_base *base;
+static size_t msg_bytes;
+
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+void
+del_proxy_client_by_stream(struct tmux_stream *stream)
+{
+}
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+on_msg(uint8_t *data, int len, void *pc)
+{
+	msg_bytes += len;
+}
+
+static struct bufferevent *
+new_bev()
+{
+	struct bufferevent *bev = bufferevent_socket_new(base, -1, 0);
+	assert(bev);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+	evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+	return bev;
+}
+
+// frames of frame_len payload on id, filling about WIRE_BYTES
+static struct evbuffer *
+build_wire(uint32_t id, uint32_t frame_len, size_t *payload)
+{
+	struct evbuffer *wire = evbuffer_new();
+	uint8_t *data = malloc(frame_len);
+	assert(wire && data);
+	memset(data, 'x', frame_len);
+	*payload = 0;
+	while (evbuffer_get_length(wire) + frame_len < WIRE_BYTES) {
+		struct tcp_mux_header hdr;
+		tcp_mux_encode(DATA, ZERO, id, frame_len, &hdr);
+		evbuffer_add(wire, &hdr, sizeof(hdr));
+		evbuffer_add(wire, data, frame_len);
+		*payload += frame_len;
+	}
+	free(data);
+	return wire;
+}
+
+static void
+bench(const char *what, uint32_t id, uint32_t frame_len, size_t read_len)
+{
+	struct tmux_session session;
+	struct tmux_stream ctl;
+	struct proxy_client *pc = calloc(1, sizeof(struct proxy_client));
+	assert(pc);
+
+	memset(&session, 0, sizeof(session));
+	memset(&ctl, 0, sizeof(ctl));
+	init_tmux_session(&session);
+	session.bev = new_bev();
+	init_tmux_stream(&ctl, CTL_ID, ESTABLISHED);
+	add_stream(&session, &ctl, NULL);
+	pc->stream_id = WORK_ID;
+	pc->work_started = 1;
+	pc->local_proxy_bev = new_bev();
+	init_tmux_stream(&pc->stream, WORK_ID, ESTABLISHED);
+	add_stream(&session, &pc->stream, pc);
+
+	size_t payload;
+	struct evbuffer *wire = build_wire(id, frame_len, &payload);
+	size_t wire_len = evbuffer_get_length(wire);
+	uint8_t *bytes = evbuffer_pullup(wire, -1);
+	struct evbuffer *input = bufferevent_get_input(session.bev);
+	struct evbuffer *local = bufferevent_get_output(pc->local_proxy_bev);
+	struct evbuffer *output = bufferevent_get_output(session.bev);
+	size_t passes = BENCH_BYTES / payload, frames = passes * (payload / frame_len);
+
+	msg_bytes = 0;
+	double start = now();
+	for (size_t n = 0; n < passes; n++) {
+		for (size_t off = 0; off < wire_len; off += read_len) {
+			size_t len = wire_len - off < read_len ? wire_len - off : read_len;
+			evbuffer_add(input, bytes + off, len);
+			handle_tcp_mux_input(&session, on_msg);
+			// the local service and frps keep up
+			evbuffer_drain(local, evbuffer_get_length(local));
+			evbuffer_drain(output, evbuffer_get_length(output));
+		}
+	}
+	double elapsed = now() - start;
+	assert(evbuffer_get_length(input) == 0);
+	assert(id == WORK_ID || msg_bytes == passes * payload);
+
+	printf("%-28s %8.1f MB/s %10.0f frames/s\n", what,
+			passes * payload / elapsed / (1024 * 1024), frames / elapsed);
+
+	evbuffer_free(wire);
+	del_stream(&session, WORK_ID);
+	del_stream(&session, CTL_ID);
+	release_tmux_stream_buffer(&pc->stream);
+	release_tmux_stream_buffer(&ctl);
+	bufferevent_free(pc->local_proxy_bev);
+	free(pc);
+	bufferevent_free(session.bev);
+	free(session.slots);
+}
+
+int main(void)
+{
+	debugconf.debuglevel = LOG_ERR;
+	conf.tcp_mux = 1;
+	conf.tcp_mux_max_window = 4*1024*1024;
+	base = event_base_new();
+	assert(base);
+
+	// reads of one 1460 byte segment, and of a 16KB socket read
+	bench("data 16KB frames, 16KB reads", WORK_ID, 16 * 1024, 16 * 1024 + 7);
+	bench("data 16KB frames, 1460 reads", WORK_ID, 16 * 1024, 1460);
+	bench("data 1KB frames, 16KB reads", WORK_ID, 1024, 16 * 1024 + 7);
+	bench("data 64B frames, 16KB reads", WORK_ID, 64, 16 * 1024 + 7);
+	bench("control 256B msgs, 16KB reads", CTL_ID, 256, 16 * 1024 + 7);
+
+	event_base_free(base);
+	return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * Standalone benchmark of an xfrpc reconnect, end to end: the real
+ * control code tears the connection down with schedule_reconnect(),
+ * connects, logs in, answers ReqWorkConn and registers every proxy; a
+ * round ends when the loop has handled the last NewProxyResp. frps is
+ * faked by a child process speaking tcp mux on a local port. Rounds run
+ * with the derived-key cache warm (as on every reconnect now) and
+ * flushed (as before). control.c is included so the bench can read its
+ * login and registration state.
+ *
+ * gcc -O2 --std=gnu99 -o benchreconnect benchreconnect.c client.c config.c \
+ *     ini.c msg.c debug.c zip.c commandline.c fastpbkdf2.c utils.c common.c \
+ *     login.c proxy_tcp.c proxy_ftp.c proxy.c tcpmux.c crypto.c \
+ *     -levent -ljson-c -lz -lcrypto -lpthread
+ * ./benchreconnect [server_addr]
+ */
+
+#include "control.c"
+
+#include <stdio.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+
+#define	ROUNDS		500
+#define	PROXIES		5
+#define	TOKEN		"bench-auth-token"
+#define	RUN_ID		"bench-run-id"
+#define	FRPS_CONNS	64
+
+// one connection to the fake frps, parsed as a tcp mux session
+struct frps_conn {
+	int					fd;
+	struct evbuffer		*in;		// raw session bytes
+	struct evbuffer		*ctl;		// payload of the control stream
+	uint32_t			ctl_id;		// 0: not opened yet
+	int					logged;
+	int					iv_read;
+	EVP_CIPHER_CTX		*dec;
+	EVP_CIPHER_CTX		*enc;
+	uint8_t				key[16];
+};
+
+static double
+now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+frps_frame(struct frps_conn *c, enum tcp_mux_type type, enum tcp_mux_flag flags,
+		uint32_t id, uint32_t length, const void *payload)
+{
+	struct tcp_mux_header hdr;
+	tcp_mux_encode(type, flags, id, length, &hdr);
+	uint8_t buf[sizeof(hdr) + 512];
+	memcpy(buf, &hdr, sizeof(hdr));
+	size_t len = sizeof(hdr);
+	if (type == DATA) {
+		assert(length <= 512);
+		memcpy(buf + len, payload, length);
+		len += length;
+	}
+	if (write(c->fd, buf, len) != (ssize_t)len)
+		exit(1);
+}
+
+// a message on the control stream, in a frame of its own as frps does
+static void
+frps_msg(struct frps_conn *c, enum msg_type type, const char *json, int enc)
+{
+	uint8_t buf[512];
+	size_t len = pack_msg(buf, type, json, strlen(json));
+	int outl = 0;
+	if (enc)
+		EVP_EncryptUpdate(c->enc, buf, &outl, buf, len);
+	frps_frame(c, DATA, ZERO, c->ctl_id, len, buf);
+}
+
+static void
+frps_login(struct frps_conn *c)
+{
+	uint8_t iv[16];
+	frps_msg(c, TypeLoginResp, "{\"version\":\"0.42.0\",\"run_id\":\"" RUN_ID "\",\"error\":\"\"}", 0);
+
+	evutil_secure_rng_get_bytes(iv, sizeof(iv));
+	encrypt_key(TOKEN, strlen(TOKEN), "frp", c->key, sizeof(c->key));
+	c->enc = EVP_CIPHER_CTX_new();
+	EVP_CipherInit_ex(c->enc, EVP_aes_128_cfb(), NULL, c->key, iv, 1);
+	frps_frame(c, DATA, ZERO, c->ctl_id, sizeof(iv), iv);
+	for (int i = 0; i < get_common_config()->pool_count; i++)
+		frps_msg(c, TypeReqWorkConn, "{}", 1);
+	c->logged = 1;
+}
+
+static void
+frps_new_proxy(struct frps_conn *c, const char *json)
+{
+	char name[64] = "", resp[256];
+	const char *p = strstr(json, "\"proxy_name\":\"");
+	if (p)
+		sscanf(p + 14, "%63[^\"]", name);
+	snprintf(resp, sizeof(resp), "{\"run_id\":\"" RUN_ID "\",\"proxy_name\":\"%s\","
+			"\"remote_addr\":\":6000\",\"error\":\"\"}", name);
+	frps_msg(c, TypeNewProxyResp, resp, 1);
+}
+
+// whole messages off the control stream, decrypted once past the login
+static void
+frps_control(struct frps_conn *c)
+{
+	for (;;) {
+		size_t len = evbuffer_get_length(c->ctl);
+		if (len < sizeof(struct msg_hdr))
+			return;
+		uint8_t *buf = evbuffer_pullup(c->ctl, len);
+		struct msg_hdr hdr;
+		memcpy(&hdr, buf, sizeof(hdr));
+		size_t body = msg_hton(hdr.length);
+		if (len < sizeof(hdr) + body)
+			return;
+
+		char json[512];
+		assert(body < sizeof(json));
+		memcpy(json, buf + sizeof(hdr), body);
+		json[body] = '\0';
+		evbuffer_drain(c->ctl, sizeof(hdr) + body);
+		if (hdr.type == TypeLogin)
+			frps_login(c);
+		else if (hdr.type == TypeNewProxy)
+			frps_new_proxy(c, json);
+	}
+}
+
+// cfb decrypts in any pieces, so the stream is decrypted as it arrives
+static void
+frps_decrypt(struct frps_conn *c, struct evbuffer *src, size_t len)
+{
+	if (!c->dec) {
+		evbuffer_remove_buffer(src, c->ctl, len);
+		return;
+	}
+	uint8_t buf[4096];
+	while (len) {
+		int n = len < sizeof(buf) ? len : sizeof(buf), outl = 0;
+		evbuffer_remove(src, buf, n);
+		EVP_DecryptUpdate(c->dec, buf, &outl, buf, n);
+		evbuffer_add(c->ctl, buf, n);
+		len -= n;
+	}
+}
+
+// frames on the session: streams are acked, pings answered, control
+// stream payload collected; work streams are only acked
+static int
+frps_input(struct frps_conn *c)
+{
+	for (;;) {
+		struct tcp_mux_header hdr;
+		if (evbuffer_copyout(c->in, &hdr, sizeof(hdr)) != sizeof(hdr))
+			return 0;
+		uint32_t id = ntohl(hdr.stream_id), length = ntohl(hdr.length);
+		uint16_t flags = ntohs(hdr.flags);
+		if (hdr.type == DATA && evbuffer_get_length(c->in) < sizeof(hdr) + length)
+			return 0;
+		evbuffer_drain(c->in, sizeof(hdr));
+
+		if (hdr.type == PING) {
+			if (flags & SYN)
+				frps_frame(c, PING, ACK, 0, length, NULL);
+			continue;
+		}
+		if (hdr.type == GO_AWAY)
+			return -1;
+		if (flags & SYN) {
+			if (!c->ctl_id)
+				c->ctl_id = id;
+			frps_frame(c, WINDOW_UPDATE, ACK, id, 0, NULL);
+		}
+		if (hdr.type != DATA)
+			continue;
+
+		if (id == c->ctl_id) {
+			// the client's iv heads what it sends after the login
+			if (c->logged && !c->iv_read) {
+				size_t need = 16 - evbuffer_get_length(c->ctl);
+				size_t take = length < need ? length : need;
+				evbuffer_remove_buffer(c->in, c->ctl, take);
+				length -= take;
+				if (evbuffer_get_length(c->ctl) == 16) {
+					uint8_t iv[16];
+					evbuffer_remove(c->ctl, iv, sizeof(iv));
+					c->dec = EVP_CIPHER_CTX_new();
+					EVP_CipherInit_ex(c->dec, EVP_aes_128_cfb(), NULL, c->key, iv, 0);
+					c->iv_read = 1;
+				}
+			}
+			frps_decrypt(c, c->in, length);
+			frps_control(c);
+		} else {
+			evbuffer_drain(c->in, length);
+		}
+	}
+}
+
+static void
+frps_close(struct frps_conn *c)
+{
+	close(c->fd);
+	evbuffer_free(c->in);
+	evbuffer_free(c->ctl);
+	if (c->enc)
+		EVP_CIPHER_CTX_free(c->enc);
+	if (c->dec)
+		EVP_CIPHER_CTX_free(c->dec);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+// the fake frps: every connection is a mux session, until killed
+static void
+frps_run(int lfd)
+{
+	static struct frps_conn conns[FRPS_CONNS];
+	struct pollfd pfd[FRPS_CONNS + 1];
+	for (int i = 0; i < FRPS_CONNS; i++)
+		conns[i].fd = -1;
+
+	for (;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (int i = 0; i < FRPS_CONNS; i++) {
+			pfd[i + 1].fd = conns[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		if (poll(pfd, FRPS_CONNS + 1, -1) < 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			int fd = accept(lfd, NULL, NULL);
+			int i = 0;
+			while (i < FRPS_CONNS && conns[i].fd >= 0)
+				i++;
+			if (fd >= 0 && i < FRPS_CONNS) {
+				int on = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				conns[i].fd = fd;
+				conns[i].in = evbuffer_new();
+				conns[i].ctl = evbuffer_new();
+			} else if (fd >= 0) {
+				close(fd);
+			}
+		}
+		for (int i = 0; i < FRPS_CONNS; i++) {
+			struct frps_conn *c = &conns[i];
+			if (c->fd < 0 || !(pfd[i + 1].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			if (evbuffer_read(c->in, c->fd, 64 * 1024) <= 0 || frps_input(c) < 0)
+				frps_close(c);
+		}
+	}
+}
+
+static int
+frps_listen(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int on = 1;
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lfd >= 0);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int r = bind(lfd, (struct sockaddr *)&sa, sizeof(sa));
+	assert(r == 0);
+	r = listen(lfd, 128);
+	assert(r == 0);
+	getsockname(lfd, (struct sockaddr *)&sa, &len);
+	*port = ntohs(sa.sin_port);
+	return lfd;
+}
+
+// after load_config(), so the child knows pool_count
+static pid_t
+frps_start(int lfd)
+{
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0)
+		frps_run(lfd);
+	close(lfd);
+	return pid;
+}
+
+static void
+write_config(const char *path, const char *host, int port)
+{
+	FILE *f = fopen(path, "w");
+	assert(f);
+	fprintf(f, "[common]\nserver_addr = %s\nserver_port = %d\ntoken = %s\n", host, port, TOKEN);
+	for (int i = 0; i < PROXIES; i++)
+		fprintf(f, "\n[bench%d]\ntype = tcp\nlocal_ip = 127.0.0.1\nlocal_port = 22\n"
+				"remote_port = %d\n", i, 6000 + i);
+	fclose(f);
+}
+
+// run the loop until every proxy is registered again
+static void
+wait_registered()
+{
+	int started = 0;
+	while (!started || register_pending) {
+		event_base_loop(main_ctl->connect_base, EVLOOP_ONCE);
+		if (is_login && register_pending)
+			started = 1;
+	}
+}
+
+static void
+bench_rounds(const char *what, int flush_keys)
+{
+	double total = 0, max = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		if (flush_keys)
+			free_key_cache();
+		double start = now_us();
+		schedule_reconnect();
+		wait_registered();
+		double us = now_us() - start;
+		total += us;
+		if (us > max)
+			max = us;
+	}
+	printf("%-26s %8.1f us avg %8.1f us max\n", what, total / ROUNDS, max);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+	char path[] = "/tmp/benchreconnect.XXXXXX";
+	int port;
+
+	debugconf.debuglevel = LOG_CRIT;
+	signal(SIGPIPE, SIG_IGN);
+	int lfd = frps_listen(&port);
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	write_config(path, host, port);
+	load_config(path);
+	unlink(path);
+	pid_t frps = frps_start(lfd);
+
+	// a reconnect right away, and every proxy offered no work connection
+	struct common_conf *c_conf = get_common_config();
+	assert(c_conf->tcp_mux);
+	c_conf->reconnect_min_interval = 0;
+	c_conf->reconnect_max_interval = 0;
+	init_login();
+	init_main_control();
+
+	double start = now_us();
+	run_control();
+	wait_registered();
+	printf("%s:%d, tcp mux, %d proxies, pool_count %d, %d rounds\n", host, port,
+			PROXIES, c_conf->pool_count, ROUNDS);
+	printf("%-26s %8.1f us\n", "first connect", now_us() - start);
+	bench_rounds("reconnect, keys cached", 0);
+	bench_rounds("reconnect, keys flushed", 1);
+
+	kill(frps, SIGKILL);
+	waitpid(frps, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Standalone benchmark of the tcp mux stream ring buffers: bytes moved
+ * from a bufferevent into rx_ring and popped out (receive side), and
+ * appended to tx_ring and popped out (parked send side). tcpmux.c is
+ * included so its static ring functions can be timed directly; point
+ * TCPMUX_SRC at another copy of the file to compare versions.
+ *
+ * gcc -O2 --std=gnu99 -o benchtcpmux benchtcpmux.c debug.c utils.c \
+ *     crypto.c fastpbkdf2.c -levent -lcrypto -lpthread
+ */
+
+#ifndef TCPMUX_SRC
+#define	TCPMUX_SRC	"tcpmux.c"
+#endif
+#include TCPMUX_SRC
+
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	HAVE_RDTSC
+#endif
+
+#define	BENCH_BYTES	(256*1024*1024)
+#define	BENCH_CHUNK	12000	// not a divisor of RBUF_SIZE, so copies wrap
+
+static struct common_conf conf;
+
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+void
+del_proxy_client_by_stream(struct tmux_stream *stream)
+{
+}
+
+static uint64_t
+ticks()
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *what, double secs, uint64_t cycles)
+{
+	printf("%-24s %8.1f MB/s", what, BENCH_BYTES / secs / (1024 * 1024));
+	if (cycles)
+		printf("  %.3f bytes/cycle", (double)BENCH_BYTES / cycles);
+	printf("\n");
+}
+
+// frps payload arriving on bev: copied into rx_ring, popped as a message
+static void
+bench_rx(struct bufferevent *bev, uint8_t *chunk, uint8_t *out)
+{
+	struct ring_buffer ring;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	double secs = 0;
+	uint64_t cycles = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+		evbuffer_add(input, chunk, BENCH_CHUNK);
+		double t = now();
+		uint64_t c = ticks();
+		uint32_t n = ring_buffer_read(bev, &ring, BENCH_CHUNK);
+		ring_buffer_pop(&ring, out, n);
+		cycles += ticks() - c;
+		secs += now() - t;
+		assert(n == BENCH_CHUNK && memcmp(out, chunk, n) == 0);
+	}
+	report("rx read+pop", secs, cycles);
+}
+
+// local data parked while the send window is closed, then taken out
+static void
+bench_tx(uint8_t *chunk, uint8_t *out)
+{
+	struct ring_buffer ring;
+	double secs = 0;
+	uint64_t cycles = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+		double t = now();
+		uint64_t c = ticks();
+		ring_buffer_append(&ring, chunk, BENCH_CHUNK);
+		ring_buffer_pop(&ring, out, BENCH_CHUNK);
+		cycles += ticks() - c;
+		secs += now() - t;
+	}
+	assert(memcmp(out, chunk, BENCH_CHUNK) == 0);
+	report("tx append+pop", secs, cycles);
+}
+
+int main(void)
+{
+	static uint8_t chunk[BENCH_CHUNK], out[BENCH_CHUNK];
+	struct event_base *base = event_base_new();
+	assert(base);
+	struct bufferevent *bev = bufferevent_socket_new(base, -1, 0);
+	assert(bev);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+
+	debugconf.debuglevel = LOG_ERR;
+	conf.tcp_mux = 1;
+	for (int i = 0; i < BENCH_CHUNK; i++)
+		chunk[i] = i % 251;
+
+	bench_rx(bev, chunk, out);
+	bench_tx(chunk, out);
+
+	bufferevent_free(bev);
+	event_base_free(base);
+	return 0;
+}
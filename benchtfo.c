@@ -0,0 +1,171 @@
+/*
+ * Standalone latency benchmark of tcp_fast_open against local frps
+ * stand-ins: time from socket() until the listener has read the first
+ * message (NewWorkConn sized), with a plain connect and with
+ * TCP_FASTOPEN_CONNECT the way connect_server_fast() sets it; against a
+ * listener with TFO, one without (the fallback) and a closed port (how
+ * long a failure takes to show).
+ *
+ * Server side TFO needs bit 2 of net.ipv4.tcp_fastopen; it is per
+ * network namespace, so without touching the host:
+ *   unshare -n sh -c 'ip link set lo up; sysctl -qw net.ipv4.tcp_fastopen=3; ./benchtfo'
+ *
+ * gcc -O2 --std=gnu99 -o benchtfo benchtfo.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define	ROUNDS		2000
+#define	PAYLOAD		"{\"proxy_name\":\"ssh\",\"run_id\":\"0123456789abcdef\",\"timestamp\":0}"
+
+struct result {
+	double	total_us;
+	double	max_us;
+	int		ok;
+	int		syn_data;	// SYN carried the payload and frps acked it
+	int		failed;
+};
+
+static double
+now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+listener(int fast, struct sockaddr_in *sa)
+{
+	socklen_t len = sizeof(*sa);
+	int on = 1, qlen = 128;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (fast && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+		perror("TCP_FASTOPEN");
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int r = bind(fd, (struct sockaddr *)sa, sizeof(*sa));
+	assert(r == 0);
+	r = listen(fd, 128);
+	assert(r == 0);
+	getsockname(fd, (struct sockaddr *)sa, &len);
+	return fd;
+}
+
+// a port nothing listens on
+static void
+closed_port(struct sockaddr_in *sa)
+{
+	int fd = listener(0, sa);
+	close(fd);
+}
+
+static void
+one_round(const struct sockaddr_in *sa, int lfd, int fast, struct result *res)
+{
+	const size_t len = strlen(PAYLOAD);
+	double start = now_us();
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fd >= 0);
+#ifdef TCP_FASTOPEN_CONNECT
+	int on = 1;
+	if (fast && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0) {
+		perror("TCP_FASTOPEN_CONNECT");
+		exit(1);
+	}
+#endif
+
+	// a closed port fails in connect() without TFO, in the first write
+	// with it
+	if (connect(fd, (const struct sockaddr *)sa, sizeof(*sa)) < 0 ||
+		write(fd, PAYLOAD, len) != (ssize_t)len) {
+		res->failed++;
+		goto done;
+	}
+
+	char buf[128];
+	size_t got = 0;
+	int cfd = accept(lfd, NULL, NULL);
+	assert(cfd >= 0);
+	while (got < len) {
+		ssize_t n = read(cfd, buf + got, sizeof(buf) - got);
+		assert(n > 0);
+		got += n;
+	}
+	close(cfd);
+	res->ok++;
+
+	struct tcp_info info;
+	socklen_t ilen = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &ilen) == 0 &&
+		(info.tcpi_options & TCPI_OPT_SYN_DATA))
+		res->syn_data++;
+
+done:
+	close(fd);
+	double us = now_us() - start;
+	res->total_us += us;
+	if (us > res->max_us)
+		res->max_us = us;
+}
+
+static void
+run(const char *what, const struct sockaddr_in *sa, int lfd, int fast)
+{
+	struct result res;
+	memset(&res, 0, sizeof(res));
+	for (int i = 0; i < ROUNDS; i++)
+		one_round(sa, lfd, fast, &res);
+
+	printf("%-28s %7.1f us avg %8.1f us max  ok %d failed %d syn data %d\n", what,
+			res.total_us / ROUNDS, res.max_us, res.ok, res.failed, res.syn_data);
+}
+
+int main(void)
+{
+#ifndef TCP_FASTOPEN_CONNECT
+	printf("no TCP_FASTOPEN_CONNECT here, xfrpc always connects plainly\n");
+	return 0;
+#else
+	struct sockaddr_in tfo, plain, closed;
+	int tfo_fd = listener(1, &tfo);
+	int plain_fd = listener(0, &plain);
+	closed_port(&closed);
+	signal(SIGPIPE, SIG_IGN);
+
+	FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+	int sysctl = -1;
+	if (f) {
+		if (fscanf(f, "%d", &sysctl) != 1)
+			sysctl = -1;
+		fclose(f);
+	}
+	printf("net.ipv4.tcp_fastopen = %d, %d rounds each\n", sysctl, ROUNDS);
+
+	run("plain -> tfo frps", &tfo, tfo_fd, 0);
+	run("tfo   -> tfo frps", &tfo, tfo_fd, 1);
+	run("plain -> stock frps", &plain, plain_fd, 0);
+	run("tfo   -> stock frps", &plain, plain_fd, 1);
+	run("plain -> closed port", &closed, -1, 0);
+	run("tfo   -> closed port", &closed, -1, 1);
+
+	close(tfo_fd);
+	close(plain_fd);
+	return 0;
+#endif
+}
@@ -48,16 +48,104 @@
 #include "proxy.h"
 #include "utils.h"
 #include "tcpmux.h"
+#include "crypto.h"
 
-static struct proxy_client 	*all_pc = NULL;
+static int idle_client_count;	// work connections offered to frps, not started yet
 
+// output flushed, and nothing left with a crypto worker
+static int
+bev_drained(struct bufferevent *bev, struct crypto_stream *cs)
+{
+	return evbuffer_get_length(bufferevent_get_output(bev)) == 0 && 
+			(!cs || !cs->inflight);
+}
+
+// a connect still under way has no socket to shut down yet
+static int
+shutdown_write(struct bufferevent *bev)
+{
+	evutil_socket_t fd = bufferevent_getfd(bev);
+	if (fd < 0)
+		return 0;
+
+	shutdown(fd, SHUT_WR);
+	return 1;
+}
+
+// non tcp mux: a side that hit EOF is no longer read, and what it sent
+// drains out of the other side before that side's write half is shut
+// down; the client goes once both directions are done
+static void
+xfrp_half_close(struct proxy_client *client)
+{
+	if (client->local_eof && !client->remote_shut && 
+		bev_drained(client->ctl_bev, client->enc))
+		client->remote_shut = shutdown_write(client->ctl_bev);
+	if (client->remote_eof && !client->local_shut && 
+		bev_drained(client->local_proxy_bev, client->dec))
+		client->local_shut = shutdown_write(client->local_proxy_bev);
+
+	if (client->remote_shut && client->local_shut)
+		del_proxy_client(client);
+}
+
+// non tcp mux: frps closed this work connection
 static void
 xfrp_worker_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
-	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+	struct proxy_client *client = ctx;
+	assert(client);
+
+	if (!(what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)))
+		return;
+
+	if ((what & BEV_EVENT_ERROR) || !client->local_proxy_bev) {
 		debug(LOG_DEBUG, "working connection closed!");
-		bufferevent_free(bev);
+		del_proxy_client(client);
+		return;
 	}
+
+	debug(LOG_DEBUG, "frps finished sending on stream %d", client->stream_id);
+	client->remote_eof = 1;
+	bufferevent_disable(bev, EV_READ);
+	xfrp_half_close(client);
+}
+
+// non tcp mux: output to frps drained
+static void
+xfrp_worker_write_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = ctx;
+	assert(client);
+
+	if (client->local_eof)
+		xfrp_half_close(client);
+}
+
+// the local service's output drained below its low watermark
+static void
+xfrp_proxy_write_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = ctx;
+	assert(client);
+
+	if (!get_common_config()->tcp_mux) {
+		if (client->remote_eof)
+			xfrp_half_close(client);
+		return;
+	}
+
+	struct tmux_stream *stream = &client->stream;
+	tmux_stream_drained(stream);
+	if (!bev_drained(bev, client->dec))
+		return;
+
+	// frps sent FIN: pass it on now that the local service has it all;
+	// once our FIN went out as well the stream is done with
+	if (stream->state == REMOTE_CLOSE && !client->local_shut)
+		client->local_shut = shutdown_write(bev);
+	else if (stream->state == CLOSED)
+		del_proxy_client(client);
 }
 
 static void 
@@ -70,8 +158,22 @@ xfrp_proxy_event_cb(struct bufferevent *bev, short what, void *ctx)
 		debug(LOG_DEBUG, "xfrpc proxy close connect server [%s:%d] stream_id %d: %s", 
 						client->ps->local_ip, client->ps->local_port, 
 						client->stream_id, strerror(errno));
-		tcp_mux_send_win_update_fin(client->ctl_bev, client->stream_id);
-		client->stream.state = LOCAL_CLOSE;
+		if (get_common_config()->tcp_mux) {
+			// nothing more reaches a broken connection
+			if (what & BEV_EVENT_ERROR) {
+				evbuffer_drain(bufferevent_get_output(bev), 
+						evbuffer_get_length(bufferevent_get_output(bev)));
+				client->local_shut = 1;
+			}
+			client->local_eof = 1;
+			tmux_stream_close(&client->stream);
+		} else if (what & BEV_EVENT_ERROR) {
+			del_proxy_client(client);
+		} else {
+			client->local_eof = 1;
+			bufferevent_disable(bev, EV_READ);
+			xfrp_half_close(client);
+		}
 	} else if (what & BEV_EVENT_CONNECTED) {
 		debug(LOG_DEBUG, "client [%d] connected", client->stream_id);
 		//client->stream.state = ESTABLISHED;
@@ -79,6 +181,8 @@ xfrp_proxy_event_cb(struct bufferevent *bev, short what, void *ctx)
 			debug(LOG_DEBUG, "send client data ...");
 			send_client_data_tail(client);		
 		}
+		// frps may have closed while the connect was under way
+		xfrp_proxy_write_cb(bev, client);
 	  }
 }
 
@@ -94,6 +198,244 @@ is_ftp_proxy(const struct proxy_service *ps)
 	return 0;
 }
 
+static void
+free_local_conn(struct local_conn *conn)
+{
+	struct proxy_service *ps = conn->ps;
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		ps->local_pool = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	ps->local_pool_count--;
+
+	if (conn->bev)
+		bufferevent_free(conn->bev);
+	free(conn);
+}
+
+static void
+local_pool_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	fill_local_pool(arg);
+}
+
+// a pooled connection must stay silent until it is handed out
+static void
+local_conn_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct local_conn *conn = ctx;
+	struct proxy_service *ps = conn->ps;
+	debug(LOG_WARNING, "proxy [%s] local service speaks first, local pool disabled", 
+					ps->proxy_name);
+	ps->local_pool_size = 0;
+	free_local_conn(conn);
+}
+
+static void
+local_conn_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct local_conn *conn = ctx;
+	struct proxy_service *ps = conn->ps;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		conn->connect_time = get_monotonic_ms();
+		bufferevent_enable(bev, EV_READ);
+		return;
+	}
+	if (!(what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)))
+		return;
+
+	if (!conn->connect_time) {
+		// local service is down, do not spin on it
+		debug(LOG_DEBUG, "proxy [%s] local pool connect [%s:%d] failed", 
+						ps->proxy_name, ps->local_ip, ps->local_port);
+		free_local_conn(conn);
+		struct timeval tv = {LOCAL_POOL_RETRY, 0};
+		evtimer_add(ps->local_pool_retry, &tv);
+		return;
+	}
+
+	// closed by the local service while idle
+	free_local_conn(conn);
+	fill_local_pool(ps);
+}
+
+// connect until local_pool_size connections are ready or on their way
+void
+fill_local_pool(struct proxy_service *ps)
+{
+	// pooled connections go to the only backend
+	if (!ps->local_pool_size || !ps->local_port || is_ftp_proxy(ps) || 
+		ps->local_down || ps->nbackend > 1)
+		return;
+
+	struct event_base *base = get_main_control()->connect_base;
+	if (!ps->local_pool_retry)
+		ps->local_pool_retry = evtimer_new(base, local_pool_retry_cb, ps);
+	if (evtimer_pending(ps->local_pool_retry, NULL))
+		return;
+
+	while (ps->local_pool_count < ps->local_pool_size) {
+		// no fast open: nothing is written to warm up the connection
+		struct bufferevent *bev = connect_server(base, ps->local_ip, ps->local_port);
+		if (!bev)
+			return;
+
+		struct local_conn *conn = calloc(1, sizeof(struct local_conn));
+		assert(conn);
+		conn->bev = bev;
+		conn->ps = ps;
+		conn->next = ps->local_pool;
+		if (conn->next)
+			conn->next->prev = conn;
+		ps->local_pool = conn;
+		ps->local_pool_count++;
+		bufferevent_setcb(bev, local_conn_read_cb, NULL, local_conn_event_cb, conn);
+	}
+}
+
+// hand out a connected pooled bev, NULL if none is ready
+static struct bufferevent *
+take_local_conn(struct proxy_service *ps)
+{
+	uint64_t now = get_monotonic_ms();
+	struct local_conn *conn = ps->local_pool, *next;
+	struct bufferevent *bev = NULL;
+
+	for (; conn && !bev; conn = next) {
+		next = conn->next;
+		if (!conn->connect_time)
+			continue;
+
+		// about to be closed by the service's idle timeout, recycle it
+		if (now - conn->connect_time < LOCAL_POOL_MAX_IDLE * 1000) {
+			bev = conn->bev;
+			conn->bev = NULL;
+		}
+		free_local_conn(conn);
+	}
+	if (bev)
+		bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	fill_local_pool(ps);
+
+	return bev;
+}
+
+static void
+health_check_result(struct local_backend *b, int ok)
+{
+	struct proxy_service *ps = b->ps;
+	if (b->health_probe) {
+		bufferevent_free(b->health_probe);
+		b->health_probe = NULL;
+	}
+
+	if (ok) {
+		b->health_failed = 0;
+		if (b->down)
+			debug(LOG_INFO, "proxy [%s] backend [%s:%d] is up", ps->proxy_name, b->ip, b->port);
+		b->down = 0;
+	} else if (++b->health_failed >= ps->health_check_max_failed && !b->down) {
+		debug(LOG_WARNING, "proxy [%s] backend [%s:%d] is down", ps->proxy_name, b->ip, b->port);
+		b->down = 1;
+	}
+
+	// the proxy is down only once none of its backends is left
+	int down = 1;
+	for (int i = 0; i < ps->nbackend; i++)
+		down = down && ps->backends[i].down;
+	if (down != ps->local_down) {
+		set_proxy_service_down(ps, down);
+		fill_local_pool(ps);
+	}
+
+	struct timeval tv = {ps->health_check_interval_s, 0};
+	evtimer_add(b->health_timer, &tv);
+}
+
+static void
+health_probe_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & BEV_EVENT_CONNECTED)
+		health_check_result(ctx, 1);
+	else if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		health_check_result(ctx, 0);
+}
+
+// one timer per backend: probe period, then timeout of the running probe
+static void
+health_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct local_backend *b = arg;
+	if (b->health_probe) {
+		debug(LOG_DEBUG, "proxy [%s] backend [%s:%d] health check timeout", 
+						b->ps->proxy_name, b->ip, b->port);
+		health_check_result(b, 0);
+		return;
+	}
+
+	b->health_probe = connect_server(get_main_control()->connect_base, b->ip, b->port);
+	if (!b->health_probe) {
+		health_check_result(b, 0);
+		return;
+	}
+	bufferevent_setcb(b->health_probe, NULL, NULL, health_probe_event_cb, b);
+
+	struct timeval tv = {b->ps->health_check_timeout_s, 0};
+	evtimer_add(b->health_timer, &tv);
+}
+
+void
+start_health_check(struct proxy_service *ps)
+{
+	if (!ps->health_check)
+		return;
+
+	for (int i = 0; i < ps->nbackend; i++) {
+		struct local_backend *b = &ps->backends[i];
+		if (b->health_timer)
+			continue;
+
+		b->health_timer = evtimer_new(get_main_control()->connect_base, health_timer_cb, b);
+		assert(b->health_timer);
+		struct timeval tv = {0, 0};
+		evtimer_add(b->health_timer, &tv);
+	}
+}
+
+// backend for a new work connection among those not known down, NULL
+// if the proxy has no backend list (ftp data proxy)
+static struct local_backend *
+pick_local_backend(struct proxy_service *ps)
+{
+	struct local_backend *best = NULL;
+	int total = 0;
+
+	for (int i = 0; i < ps->nbackend; i++) {
+		struct local_backend *b = &ps->backends[i];
+		if (b->down)
+			continue;
+
+		if (ps->lb_policy == LB_LEAST_CONN) {
+			// fewest active streams relative to weight
+			if (!best || b->active * best->weight < best->active * b->weight)
+				best = b;
+		} else {
+			// smooth weighted round robin
+			b->current_weight += b->weight;
+			total += b->weight;
+			if (!best || b->current_weight > best->current_weight)
+				best = b;
+		}
+	}
+	if (best && ps->lb_policy == LB_ROUND_ROBIN)
+		best->current_weight -= total;
+
+	return best;
+}
+
 // create frp tunnel for service
 void 
 start_xfrp_tunnel(struct proxy_client *client)
@@ -122,9 +464,43 @@ start_xfrp_tunnel(struct proxy_client *client)
 		return;
 	}
 
-	client->local_proxy_bev = connect_server(base, ps->local_ip, ps->local_port);
+	// the health check found the service down: fail now rather than
+	// leave the user waiting on a connect that will not succeed
+	if (ps->local_down) {
+		debug(LOG_DEBUG, "proxy [%s] local service is down, reset stream %d", 
+						ps->proxy_name, client->stream_id);
+		if (c_conf->tcp_mux)
+			tcp_mux_send_win_update_rst(client->ctl_bev, client->stream_id);
+		del_proxy_client(client);
+		return;
+	}
+
+	const char *local_ip = ps->local_ip;
+	int local_port = ps->local_port;
+	struct local_backend *backend = pick_local_backend(ps);
+	if (backend) {
+		local_ip = backend->ip;
+		local_port = backend->port;
+		client->backend = backend;
+		backend->active++;
+	}
+
+	// each side sends its iv first, then the aes-128-cfb stream
+	if (ps->use_encryption) {
+		client->enc = new_crypto_stream(c_conf->auth_token, 1);
+		client->dec = new_crypto_stream(c_conf->auth_token, 0);
+		if (c_conf->tcp_mux)
+			tmux_write(client->ctl_bev, client->enc->iv, sizeof(client->enc->iv), &client->stream);
+		else
+			bufferevent_write(client->ctl_bev, client->enc->iv, sizeof(client->enc->iv));
+	}
+
+	client->local_proxy_bev = take_local_conn(ps);
+	int pooled = client->local_proxy_bev != NULL;
+	if (!pooled)
+		client->local_proxy_bev = connect_server_fast(base, local_ip, local_port);
 	if ( !client->local_proxy_bev ) {
-		debug(LOG_ERR, "frpc tunnel connect local proxy port [%d] failed!", ps->local_port);
+		debug(LOG_ERR, "frpc tunnel connect local proxy port [%d] failed!", local_port);
 		del_proxy_client(client);
 		return;
 	}
@@ -132,8 +508,8 @@ start_xfrp_tunnel(struct proxy_client *client)
 	debug(LOG_DEBUG, "proxy server [%s:%d] <---> client [%s:%d]", 
 		  c_conf->server_addr, 
 		  ps->remote_port, 
-		  ps->local_ip ? ps->local_ip:"::1",
-		  ps->local_port);
+		  local_ip ? local_ip:"::1",
+		  local_port);
 
 	bufferevent_data_cb proxy_s2c_recv, proxy_c2s_recv;
 	if (is_ftp_proxy(client->ps)) {
@@ -147,7 +523,7 @@ start_xfrp_tunnel(struct proxy_client *client)
 	if (!c_conf->tcp_mux) {
 		bufferevent_setcb(client->ctl_bev, 
 						proxy_s2c_recv, 
-						NULL, 
+						xfrp_worker_write_cb, 
 						xfrp_worker_event_cb, 
 						client);
 		bufferevent_enable(client->ctl_bev, EV_READ|EV_WRITE);
@@ -155,11 +531,20 @@ start_xfrp_tunnel(struct proxy_client *client)
 
 	bufferevent_setcb(client->local_proxy_bev, 
 						proxy_c2s_recv, 
-						NULL, 
+						xfrp_proxy_write_cb, 
 						xfrp_proxy_event_cb, 
 						client);
+	// mux window updates follow what the local service actually reads
+	if (c_conf->tcp_mux)
+		bufferevent_setwatermark(client->local_proxy_bev, EV_WRITE, 
+						client->stream.max_recv_window / 2, 0);
 						
 	bufferevent_enable(client->local_proxy_bev, EV_READ|EV_WRITE);
+
+	// data_tail points into the message being handled: queue it now, it
+	// goes out once the local connection is up
+	if (client->data_tail_size > 0)
+		send_client_data_tail(client);
 }
 
 int 
@@ -167,7 +552,18 @@ send_client_data_tail(struct proxy_client *client)
 {
 	int send_l = 0;
 	if (client->data_tail && client->data_tail_size && client->local_proxy_bev) {
-		send_l = bufferevent_write(client->local_proxy_bev, client->data_tail, client->data_tail_size);
+		if (client->dec) {
+			struct evbuffer *tail = evbuffer_new();
+			assert(tail);
+			evbuffer_add(tail, client->data_tail, client->data_tail_size);
+			struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
+			size_t before = evbuffer_get_length(dst);
+			crypto_stream_open(client->dec, tail, client->data_tail_size, dst);
+			send_l = evbuffer_get_length(dst) - before;
+			evbuffer_free(tail);
+		} else {
+			send_l = bufferevent_write(client->local_proxy_bev, client->data_tail, client->data_tail_size);
+		}
 		client->data_tail = NULL;
 		client->data_tail_size = 0;
 	}
@@ -179,59 +575,98 @@ static void
 free_proxy_client(struct proxy_client *client)
 {
 	if (client->local_proxy_bev) bufferevent_free(client->local_proxy_bev);
+	if (client->backend) client->backend->active--;
+	free_crypto_stream(client->enc);
+	free_crypto_stream(client->dec);
+	// without tcp mux ctl_bev is this client's own connection to frps
+	if (!get_common_config()->tcp_mux && client->ctl_bev) 
+		bufferevent_free(client->ctl_bev);
+	release_tmux_stream_buffer(&client->stream);
 	free(client);
 }
 
 void 
 del_proxy_client(struct proxy_client *client)
 {
-	if (!client || !all_pc ) {
-		debug(LOG_INFO, "all_pc or client is NULL");
+	if (!client) {
+		debug(LOG_INFO, "client is NULL");
 		return;
 	}
 	
-	HASH_DEL(all_pc, client);
+	if (client->stream.session)
+		del_stream(client->stream.session, client->stream_id);
+	if (!client->work_started)
+		idle_client_count--;
 	
 	free_proxy_client(client);
 }
 
 void
-del_proxy_client_by_stream_id(uint32_t sid)
+del_proxy_client_by_stream(struct tmux_stream *stream)
 {
-	del_stream(sid);
-
-	struct proxy_client *pc = get_proxy_client(sid);
-	del_proxy_client(pc);
+	struct tmux_session *session = stream->session;
+	struct proxy_client *pc = get_proxy_client(session, stream->id);
+	if (pc)
+		del_proxy_client(pc);
+	else
+		del_stream(session, stream->id);
 }
 
 struct proxy_client *
-get_proxy_client(uint32_t sid)
+get_proxy_client(struct tmux_session *session, uint32_t sid)
 {
-	struct proxy_client *pc = NULL;
-	HASH_FIND_INT(all_pc, &sid, pc);
-	return pc;
+	struct tmux_slot *slot = get_stream_slot(session, sid);
+	return slot ? slot->pc : NULL;
 }
 
+// the stream takes its id from, and is framed on, session
 struct proxy_client *
-new_proxy_client()
+new_proxy_client(struct tmux_session *session)
 {
 	struct proxy_client *client = calloc(1, sizeof(struct proxy_client));
 	assert(client);
-	client->stream_id   = get_next_session_id();
+	client->stream_id   = get_next_session_id(session);
 	init_tmux_stream(&client->stream, client->stream_id, INIT);
-	HASH_ADD_INT(all_pc, stream_id, client);
+	add_stream(session, &client->stream, client);
+	idle_client_count++;
 	
 	return client;
 }
 
 void
-clear_all_proxy_client()
+set_proxy_client_work_started(struct proxy_client *client, int started)
 {
-	if (!all_pc) return;
-	
-	struct proxy_client *client, *tmp;
-	HASH_ITER(hh, all_pc, client, tmp) {
-		HASH_DEL(all_pc, client);
-		free_proxy_client(client);
-	}
+	started = !!started;
+	if (client->work_started == started)
+		return;
+
+	idle_client_count += started ? -1 : 1;
+	client->work_started = started;
+}
+
+int
+get_idle_proxy_client_count()
+{
+	return idle_client_count;
+}
+
+void
+clear_session_proxy_client(struct tmux_session *session)
+{
+	foreach_stream_client(session, del_proxy_client);
+}
+
+static void
+del_idle_proxy_client(struct proxy_client *client)
+{
+	if (!client->work_started)
+		del_proxy_client(client);
+}
+
+// without tcp mux a started work connection is its own link to frps and
+// keeps serving while the control connection is re-established
+void
+clear_session_idle_proxy_client(struct tmux_session *session)
+{
+	foreach_stream_client(session, del_idle_proxy_client);
 }
@@ -33,11 +33,22 @@
 #include "common.h"
 #include "tcpmux.h"
 
+#define	LOCAL_POOL_MAX			64
+#define	LOCAL_POOL_MAX_IDLE		30	// s, older pooled connections are not handed out
+#define	LOCAL_POOL_RETRY		1	// s, wait after a failed pool connect
+
+#define	LOCAL_BACKENDS_MAX		32
+
+#define	HEALTH_CHECK_TIMEOUT	3	// s, defaults of the health_check_* options
+#define	HEALTH_CHECK_MAX_FAILED	1
+#define	HEALTH_CHECK_INTERVAL	10
+
 struct event_base;
 struct base_conf;
 struct bufferevent;
 struct event;
 struct proxy_service;
+struct crypto_stream;
 
 struct proxy_client {
 	struct event_base 	*base;
@@ -49,12 +60,47 @@ struct proxy_client {
 	uint32_t				stream_id;
 	int						connected;
 	int 					work_started;
+	uint64_t				connect_time;	// work connection setup began, monotonic ms
+	struct local_backend	*backend;	// local service picked for this client
+	struct crypto_stream	*enc;	// use_encryption: local service ---> frps
+	struct crypto_stream	*dec;	// use_encryption: frps ---> local service
+	uint8_t					local_eof;		// local service closed its side
+	uint8_t					remote_eof;		// non tcp mux: frps closed its side
+	uint8_t					local_shut;		// local write half shut down
+	uint8_t					remote_shut;	// non tcp mux: frps write half shut down
 	struct 	proxy_service 	*ps;
 	unsigned char			*data_tail; // storage untreated data
 	size_t					data_tail_size;
-	
-	// private arguments
-	UT_hash_handle hh;
+};
+
+// warm connection to a proxy's local service, see local_pool_size
+struct local_conn {
+	struct bufferevent		*bev;
+	struct proxy_service	*ps;
+	uint64_t				connect_time;	// monotonic ms, 0 while connecting
+	struct local_conn		*next;
+	struct local_conn		*prev;
+};
+
+enum lb_policy {
+	LB_ROUND_ROBIN = 0,	// smooth weighted round robin
+	LB_LEAST_CONN,
+};
+
+// one local service behind a proxy, see local_backends
+struct local_backend {
+	char					*ip;
+	int						port;
+	int						weight;
+	int						current_weight;
+	int						active;		// proxy clients using it
+	struct proxy_service	*ps;
+
+	// health check
+	int						down;
+	int						health_failed;
+	struct bufferevent		*health_probe;
+	struct event			*health_timer;
 };
 
 struct proxy_service {
@@ -63,6 +109,7 @@ struct proxy_service {
 	char 	*ftp_cfg_proxy_name;
 	int 	use_encryption;
 	int		use_compression;
+	int		weight;		// tcp mux transmit share
 
 	char	*local_ip;
 	int		remote_port;
@@ -77,7 +124,30 @@ struct proxy_service {
 	char	*http_user;
 	char	*http_pwd;
 
+	// local connections kept ready for work connections, 0 disables;
+	// only for services that wait for the client to speak first
+	int		local_pool_size;
+
+	// local_backends = host:port[:weight], ... spreads work connections
+	// over several local services, local_ip/local_port is the only one
+	// otherwise; a health check probes each of them
+	struct local_backend	*backends;
+	int		nbackend;
+	enum lb_policy	lb_policy;
+
+	// tcp connect probes of the local service, 0 disables
+	int		health_check;
+	int		health_check_timeout_s;
+	int		health_check_max_failed;
+	int		health_check_interval_s;
+
 	// private arguments
+	struct local_conn	*local_pool;
+	int					local_pool_count;	// connected and connecting
+	struct event		*local_pool_retry;
+	int					local_down;		// every backend is down
+	char				*new_proxy_msg;	// NewProxy json, kept across reconnects
+	int					new_proxy_len;
 	UT_hash_handle hh;
 };
 
@@ -90,16 +160,26 @@ void start_xfrp_tunnel(struct proxy_client *client);
 
 void del_proxy_client(struct proxy_client *client);
 
-void del_proxy_client_by_stream_id(uint32_t sid);
+void del_proxy_client_by_stream(struct tmux_stream *stream);
 
-struct proxy_client	*get_proxy_client(uint32_t sid);
+struct proxy_client	*get_proxy_client(struct tmux_session *session, uint32_t sid);
 
 int send_client_data_tail(struct proxy_client *client);
 
 int is_ftp_proxy(const struct proxy_service *ps);
 
-struct proxy_client *new_proxy_client();
+struct proxy_client *new_proxy_client(struct tmux_session *session);
+
+void clear_session_proxy_client(struct tmux_session *session);
+
+void clear_session_idle_proxy_client(struct tmux_session *session);
+
+void set_proxy_client_work_started(struct proxy_client *client, int started);
+
+int get_idle_proxy_client_count();
+
+void fill_local_pool(struct proxy_service *ps);
 
-void clear_all_proxy_client();
+void start_health_check(struct proxy_service *ps);
 
 #endif //_CLIENT_H_
@@ -38,6 +38,7 @@
 #include "client.h"
 #include "debug.h"
 #include "msg.h"
+#include "crypto.h"
 #include "utils.h"
 #include "version.h"
 
@@ -57,6 +58,7 @@ void free_common_config()
 
 	if (c_conf->server_addr) free(c_conf->server_addr);
 	if (c_conf->auth_token) free(c_conf->auth_token);
+	if (c_conf->work_cipher) free(c_conf->work_cipher);
 };
 
 static int is_true(const char *val)
@@ -95,6 +97,73 @@ static void dump_common_conf()
 			 c_conf->heartbeat_interval, c_conf->heartbeat_timeout);
 }
 
+static void add_local_backend(struct proxy_service *ps, const char *ip, int port, int weight)
+{
+	ps->backends = realloc(ps->backends, (ps->nbackend + 1) * sizeof(struct local_backend));
+	assert(ps->backends);
+	struct local_backend *b = &ps->backends[ps->nbackend++];
+	memset(b, 0, sizeof(*b));
+	b->ip = strdup(ip);
+	assert(b->ip);
+	b->port = port;
+	b->weight = weight;
+	b->ps = ps;
+}
+
+// local_backends = host:port[:weight], [ipv6]:port[:weight], ...
+// return 0 on a malformed entry
+static int parse_local_backends(struct proxy_service *ps, const char *value)
+{
+	char *tmp = strdup(value);
+	assert(tmp);
+	char *tok = tmp, *end = tmp;
+	int ok = 1;
+	while (ok && tok != NULL) {
+		strsep(&end, ",");
+		while (*tok == ' ' || *tok == '\t')
+			tok++;
+
+		char *host = tok, *port = NULL, *weight = NULL;
+		if (*host == '[') {
+			host++;
+			char *close = strchr(host, ']');
+			if (close) {
+				*close = '\0';
+				port = close[1] == ':' ? close + 2 : NULL;
+			}
+		} else {
+			port = strchr(host, ':');
+			if (port)
+				*port++ = '\0';
+		}
+		if (port) {
+			weight = strchr(port, ':');
+			if (weight)
+				*weight++ = '\0';
+		}
+
+		int p = port ? atoi(port) : 0;
+		int w = weight ? atoi(weight) : 1;
+		if (!*host || p <= 0 || p > 65535 || w < 1 || w > 64 || 
+			ps->nbackend >= LOCAL_BACKENDS_MAX) {
+			ok = 0;
+			break;
+		}
+		add_local_backend(ps, host, p, w);
+		tok = end;
+	}
+	SAFE_FREE(tmp);
+
+	if (ok && ps->nbackend) {
+		// the first backend also stands for the proxy in logs and probes
+		SAFE_FREE(ps->local_ip);
+		ps->local_ip = strdup(ps->backends[0].ip);
+		assert(ps->local_ip);
+		ps->local_port = ps->backends[0].port;
+	}
+	return ok;
+}
+
 static void dump_proxy_service(const int index, struct proxy_service *ps)
 {
 	if (!ps)
@@ -105,10 +174,26 @@ static void dump_proxy_service(const int index, struct proxy_service *ps)
 		exit(0);
 	}
 
+	if (ps->health_check && (ps->health_check_timeout_s < 1 || 
+		ps->health_check_max_failed < 1 || ps->health_check_interval_s < 1)) {
+		debug(LOG_ERR, "Proxy [%s] error: health_check_* values must be positive", ps->proxy_name);
+		exit(0);
+	}
+
+	// the ftp data proxy port is only known per transfer
+	if (!ps->nbackend && !ps->ftp_cfg_proxy_name)
+		add_local_backend(ps, ps->local_ip ? ps->local_ip : "127.0.0.1", ps->local_port, 1);
+
 	if (NULL == ps->proxy_type) {
 		ps->proxy_type = strdup("tcp");
 		assert(ps->proxy_type);
 	} else if (strcmp(ps->proxy_type, "ftp") == 0) {
+		// the PASV rewrite needs the plain control stream
+		if (ps->use_encryption) {
+			debug(LOG_WARNING, "Proxy [%s]: use_encryption is not supported for ftp, disabled", 
+							ps->proxy_name);
+			ps->use_encryption = 0;
+		}
 		new_ftp_data_proxy_service(ps);
 	}
 
@@ -150,6 +235,15 @@ static struct proxy_service *new_proxy_service(const char *name)
 	ps->remote_data_port	= -1;
 	ps->use_compression 	= 0;
 	ps->use_encryption		= 0;
+	ps->weight				= 1;
+	ps->local_pool_size		= 0;
+	ps->backends			= NULL;
+	ps->nbackend			= 0;
+	ps->lb_policy			= LB_ROUND_ROBIN;
+	ps->health_check		= 0;
+	ps->health_check_timeout_s	= HEALTH_CHECK_TIMEOUT;
+	ps->health_check_max_failed	= HEALTH_CHECK_MAX_FAILED;
+	ps->health_check_interval_s	= HEALTH_CHECK_INTERVAL;
 
 	ps->custom_domains		= NULL;
 	ps->subdomain			= NULL;
@@ -183,6 +277,7 @@ static void new_ftp_data_proxy_service(struct proxy_service *ftp_ps)
 		ps->remote_port = ftp_ps->remote_data_port;
 		ps->local_ip = ftp_ps->local_ip;
 		ps->local_port = 0; //will be init in working tunnel connectting
+		ps->weight = ftp_ps->weight;
 
 		HASH_ADD_KEYPTR(hh, all_ps, ps->proxy_name, strlen(ps->proxy_name), ps);
 	}
@@ -254,6 +349,54 @@ proxy_service_handler(void *user, const char *sect, const char *nm, const char *
 		ps->use_encryption = TO_BOOL(value);
 	} else if (MATCH_NAME("use_compression")) {
 		ps->use_compression = TO_BOOL(value);
+	} else if (MATCH_NAME("local_pool_size")) {
+		ps->local_pool_size = atoi(value);
+		if (ps->local_pool_size < 0 || ps->local_pool_size > LOCAL_POOL_MAX) {
+			debug(LOG_ERR, "proxy service %s local_pool_size %s out of range [0, %d]", 
+							ps->proxy_name, value, LOCAL_POOL_MAX);
+			SAFE_FREE(section);
+			exit(0);
+		}
+	} else if (MATCH_NAME("local_backends")) {
+		if (ps->nbackend || !parse_local_backends(ps, value)) {
+			debug(LOG_ERR, "proxy service %s local_backends %s invalid", 
+							ps->proxy_name, value);
+			SAFE_FREE(section);
+			exit(0);
+		}
+	} else if (MATCH_NAME("lb_policy")) {
+		if (strcmp(value, "round_robin") == 0) {
+			ps->lb_policy = LB_ROUND_ROBIN;
+		} else if (strcmp(value, "least_conn") == 0) {
+			ps->lb_policy = LB_LEAST_CONN;
+		} else {
+			debug(LOG_ERR, "proxy service %s lb_policy %s not supported", 
+							ps->proxy_name, value);
+			SAFE_FREE(section);
+			exit(0);
+		}
+	} else if (MATCH_NAME("health_check_type")) {
+		if (strcmp(value, "tcp") != 0) {
+			debug(LOG_ERR, "proxy service %s health_check_type %s not supported, only tcp", 
+							ps->proxy_name, value);
+			SAFE_FREE(section);
+			exit(0);
+		}
+		ps->health_check = 1;
+	} else if (MATCH_NAME("health_check_timeout_s")) {
+		ps->health_check_timeout_s = atoi(value);
+	} else if (MATCH_NAME("health_check_max_failed")) {
+		ps->health_check_max_failed = atoi(value);
+	} else if (MATCH_NAME("health_check_interval_s")) {
+		ps->health_check_interval_s = atoi(value);
+	} else if (MATCH_NAME("weight")) {
+		ps->weight = atoi(value);
+		if (ps->weight < 1 || ps->weight > 64) {
+			debug(LOG_ERR, "proxy service %s weight %s out of range [1, 64]", 
+							ps->proxy_name, value);
+			SAFE_FREE(section);
+			exit(0);
+		}
 	}
 
 	SAFE_FREE(section);
@@ -282,6 +425,26 @@ static int common_handler(void *user, const char *section, const char *name, con
 	} else if (MATCH("common", "tcp_mux")) {
 		config->tcp_mux = atoi(value);
 		config->tcp_mux = !!config->tcp_mux;
+	} else if (MATCH("common", "tcp_mux_max_window")) {
+		config->tcp_mux_max_window = strtoul(value, NULL, 10);
+	} else if (MATCH("common", "tcp_mux_connections")) {
+		config->tcp_mux_connections = atoi(value);
+	} else if (MATCH("common", "tcp_mux_keepalive_interval")) {
+		config->tcp_mux_keepalive_interval = atoi(value);
+	} else if (MATCH("common", "reconnect_min_interval")) {
+		config->reconnect_min_interval = atoi(value);
+	} else if (MATCH("common", "reconnect_max_interval")) {
+		config->reconnect_max_interval = atoi(value);
+	} else if (MATCH("common", "pool_count")) {
+		config->pool_count = atoi(value);
+	} else if (MATCH("common", "tcp_fast_open")) {
+		config->tcp_fast_open = !!atoi(value);
+	} else if (MATCH("common", "crypto_threads")) {
+		config->crypto_threads = atoi(value);
+	} else if (MATCH("common", "work_cipher")) {
+		SAFE_FREE(config->work_cipher);
+		config->work_cipher = strdup(value);
+		assert(config->work_cipher);
 	}
 	return 1;
 }
@@ -297,6 +460,14 @@ static void init_common_conf(struct common_conf *config)
 	config->heartbeat_interval 	= 30;
 	config->heartbeat_timeout	= 90;
 	config->tcp_mux				= 1;
+	config->tcp_mux_max_window	= 4*1024*1024;
+	config->tcp_mux_connections	= 1;
+	config->tcp_mux_keepalive_interval	= 10;
+	config->reconnect_min_interval	= 1;
+	config->reconnect_max_interval	= 60;
+	config->pool_count			= 1;
+	config->tcp_fast_open		= 0;
+	config->crypto_threads		= 0;
 	config->is_router			= 0;
 }
 
@@ -343,6 +514,37 @@ void load_config(const char *confile)
 		debug(LOG_ERR, "Error: heartbeat_timeout < heartbeat_interval");
 		exit(0);
 	}
+
+	if (c_conf->tcp_mux_max_window < MAX_STREAM_WINDOW_SIZE) {
+		debug(LOG_ERR, "Error: tcp_mux_max_window < %d", MAX_STREAM_WINDOW_SIZE);
+		exit(0);
+	}
+
+	if (c_conf->reconnect_min_interval <= 0 || 
+		c_conf->reconnect_max_interval < c_conf->reconnect_min_interval) {
+		debug(LOG_ERR, "Error: need 0 < reconnect_min_interval <= reconnect_max_interval");
+		exit(0);
+	}
+
+	if (c_conf->pool_count < 0 || c_conf->pool_count > 100) {
+		debug(LOG_ERR, "Error: pool_count must be in [0, 100]");
+		exit(0);
+	}
+
+	if (c_conf->crypto_threads < 0 || c_conf->crypto_threads > CRYPTO_MAX_THREADS) {
+		debug(LOG_ERR, "Error: crypto_threads must be in [0, %d]", CRYPTO_MAX_THREADS);
+		exit(0);
+	}
+
+	if (set_work_cipher(c_conf->work_cipher) < 0) {
+		debug(LOG_ERR, "Error: unknown work_cipher %s", c_conf->work_cipher);
+		exit(0);
+	}
+
+	if (c_conf->tcp_mux_connections < 1 || c_conf->tcp_mux_connections > TMUX_MAX_SESSIONS) {
+		debug(LOG_ERR, "Error: tcp_mux_connections must be in [1, %d]", TMUX_MAX_SESSIONS);
+		exit(0);
+	}
 	
 	ini_parse(confile, proxy_service_handler, NULL);
 	
@@ -39,6 +39,15 @@ struct common_conf {
 	int		heartbeat_interval; /* default 10 */
 	int		heartbeat_timeout;	/* default 30 */
 	int 	tcp_mux;		/* default 0 */
+	uint32_t	tcp_mux_max_window;	/* default 4M, ceiling of auto-tuned stream window */
+	int		tcp_mux_connections;	/* default 1, mux sessions opened to frps */
+	int		tcp_mux_keepalive_interval;	/* default 10s, mux ping period, 0 disables */
+	int		reconnect_min_interval;	/* default 1s, first reconnect backoff */
+	int		reconnect_max_interval;	/* default 60s, backoff ceiling */
+	int		pool_count;		/* default 1, work connections frps keeps ready */
+	int		tcp_fast_open;	/* default 0, TFO for work and local service connections */
+	int		crypto_threads;	/* default 0, worker threads for use_encryption, 0 is inline */
+	char	*work_cipher;	/* default aes-128-cfb, others are experimental */
 
 	/* private fields */
 	int 	is_router;	// to sign router (Openwrt/LEDE) or not
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <json-c/json.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -54,13 +55,26 @@
 static struct control *main_ctl;
 static int client_connected = 0;
 static int is_login = 0;
-static time_t pong_time = 0;
+static uint64_t pong_time = 0;	// monotonic ms
+
+// ReqWorkConn pacing, sizes the number of work connections kept offered
+static uint64_t req_work_time;		// last ReqWorkConn, monotonic ms
+static uint32_t req_work_interval;	// smoothed gap between ReqWorkConn, ms
+static uint32_t req_work_count;		// since login
+static uint32_t work_setup_ms;		// smoothed non mux work connection setup
+
+// reconnect latency: control connection up to every proxy registered
+static uint64_t connect_time;		// monotonic ms
+static int register_total;
+static int register_pending;		// NewProxy not answered yet
 
 static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream);
 static void recv_cb(struct bufferevent *bev, void *ctx);
 static void clear_main_control();
 static void start_base_connect();
 static void keep_control_alive();
+static void open_mux_session(struct tmux_session *session);
+static void schedule_reconnect();
 
 static int 
 is_client_connected()
@@ -83,10 +97,7 @@ static int
 set_client_work_start(struct proxy_client *client, int is_start_work)
 {
 	assert(client->ps);
-	if (is_start_work) {
-		client->work_started = 1;
-	}else
-		client->work_started = 0;
+	set_proxy_client_work_started(client, is_start_work);
 
 	return client->work_started;
 }
@@ -101,13 +112,13 @@ client_start_event_cb(struct bufferevent *bev, short what, void *ctx)
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
 		if (client->ctl_bev != bev) {
 			debug(LOG_ERR, "Error: should be equal");
-			bufferevent_free(client->ctl_bev);
-			client->ctl_bev = NULL;
+			bufferevent_free(bev);
 		}
 		debug(LOG_ERR, "Proxy connect server [%s:%d] error: %s", c_conf->server_addr, c_conf->server_port, strerror(errno));
-		bufferevent_free(bev);
 		del_proxy_client(client);
 	} else if (what & BEV_EVENT_CONNECTED) {
+		uint32_t setup = get_monotonic_ms() - client->connect_time;
+		work_setup_ms = work_setup_ms ? (3 * work_setup_ms + setup) / 4 : setup;
 		bufferevent_setcb(bev, recv_cb, NULL, client_start_event_cb, client);
 		bufferevent_enable(bev, EV_READ|EV_WRITE);
 		new_work_connection(bev, &main_ctl->stream);
@@ -116,26 +127,54 @@ client_start_event_cb(struct bufferevent *bev, short what, void *ctx)
 	}
 }
 
-static void 
+// new work streams go to the connected session carrying the fewest
+// streams, ties broken by the least output still queued
+static struct tmux_session *
+pick_mux_session()
+{
+	struct tmux_session *best = &main_ctl->sessions[0];
+	size_t best_out = evbuffer_get_length(bufferevent_get_output(best->bev));
+	for (int i = 1; i < main_ctl->nsession; i++) {
+		struct tmux_session *session = &main_ctl->sessions[i];
+		if (!session->ready)
+			continue;
+
+		size_t out = evbuffer_get_length(bufferevent_get_output(session->bev));
+		if (session->slot_used < best->slot_used || 
+			(session->slot_used == best->slot_used && out < best_out)) {
+			best = session;
+			best_out = out;
+		}
+	}
+
+	return best;
+}
+
+// return 0 if no work connection could be started
+static int 
 new_client_connect()
 {
-	struct proxy_client *client = new_proxy_client();
 	struct common_conf *c_conf = get_common_config();
 	assert(c_conf);
+	struct tmux_session *session = c_conf->tcp_mux ? pick_mux_session() : &main_ctl->sessions[0];
+	struct proxy_client *client = new_proxy_client(session);
 	client->base = main_ctl->connect_base;
 	
 	if (c_conf->tcp_mux) {
-		debug(LOG_DEBUG, "new client through tcp mux: %d", client->stream_id);
-		client->ctl_bev 	= main_ctl->connect_bev;
+		debug(LOG_DEBUG, "new client through tcp mux session %d: %d", 
+						(int)(session - main_ctl->sessions), client->stream_id);
+		client->ctl_bev 	= session->bev;
 		send_window_update(client->ctl_bev, &client->stream, 0);
 		new_work_connection(client->ctl_bev, &client->stream);
-		return;
+		return 1;
 	}
 
-	struct bufferevent *bev = connect_server(client->base, c_conf->server_addr, c_conf->server_port);
+	client->connect_time = get_monotonic_ms();
+	struct bufferevent *bev = connect_server_fast(client->base, c_conf->server_addr, c_conf->server_port);
 	if (!bev) {
 		debug(LOG_DEBUG, "Connect server [%s:%d] failed", c_conf->server_addr, c_conf->server_port);
-		return;
+		del_proxy_client(client);
+		return 0;
 	}
 
 	debug(LOG_INFO, "work connection: connect server [%s:%d] ......", c_conf->server_addr, c_conf->server_port);
@@ -143,6 +182,53 @@ new_client_connect()
 	client->ctl_bev = bev;
 	bufferevent_enable(bev, EV_WRITE);
 	bufferevent_setcb(bev, NULL, NULL, client_start_event_cb, client);
+	return 1;
+}
+
+static void
+note_req_work_conn()
+{
+	uint64_t now = get_monotonic_ms();
+	// the first pool_count requests after login only fill frps's pool
+	if (++req_work_count > get_common_config()->pool_count && req_work_time) {
+		uint32_t gap = now - req_work_time;
+		req_work_interval = req_work_interval ? (3 * req_work_interval + gap) / 4 : gap;
+	}
+	req_work_time = now;
+}
+
+// work connections to keep offered: pool_count, plus as many as are
+// expected to be requested while one more is being set up; frps holds
+// at most pool_count + WORK_POOL_HEADROOM of them and drops the rest
+static int
+work_pool_target()
+{
+	struct common_conf *c_conf = get_common_config();
+	uint32_t setup = c_conf->tcp_mux ? main_ctl->sessions[0].srtt : work_setup_ms;
+	int target = c_conf->pool_count;
+	if (req_work_interval && setup) {
+		uint32_t extra = (setup + req_work_interval - 1) / req_work_interval;
+		target += extra > WORK_POOL_HEADROOM ? WORK_POOL_HEADROOM : extra;
+	}
+
+	return target;
+}
+
+// frps asks for a work connection each time it hands one out; answer it
+// and, when requests come faster than connections are set up, offer a
+// few more ahead of time so a burst of users does not wait on connects
+static void
+handle_req_work_conn()
+{
+	note_req_work_conn();
+	if (!new_client_connect())
+		return;
+
+	int target = work_pool_target();
+	for (int n = 0; n < WORK_POOL_HEADROOM && get_idle_proxy_client_count() < target; n++) {
+		if (!new_client_connect())
+			break;
+	}
 }
 
 static void 
@@ -157,14 +243,22 @@ start_proxy_services()
 	}
 
 	debug(LOG_INFO, "Start xfrp proxy services ...");
+	register_total = 0;
 	
 	HASH_ITER(hh, all_ps, ps, tmp) {
 		if(ps == NULL) {
 			debug(LOG_ERR, "proxy service is invalid!");
 			return;
 		}
-		send_new_proxy(ps);
+		// a proxy whose local service is down is registered once it is back
+		if (!ps->local_down) {
+			send_new_proxy(ps);
+			register_total++;
+		}
+		fill_local_pool(ps);
+		start_health_check(ps);
 	}
+	register_pending = register_total;
 }
 
 static void 
@@ -207,21 +301,451 @@ new_work_connection(struct bufferevent *bev, struct tmux_stream *stream)
 	SAFE_FREE(work_c);
 }
 
-struct bufferevent *
-connect_server(struct event_base *base, const char *name, const int port)
+// connects waiting for the first answer of a host not resolved yet
+struct dns_waiter {
+	struct bufferevent	*bev;
+	int					port;
+	int					fast;
+	struct dns_waiter	*next;
+};
+
+// resolved addresses of a host; expired entries are still used while
+// they are refreshed, so only the very first connect waits on DNS
+struct dns_entry {
+	char				*name;
+	struct in_addr		v4;
+	struct in6_addr		v6;
+	int					has_v4;
+	int					has_v6;
+	int					prefer_v4;	// ipv4 won the last race
+	uint64_t			expire;		// monotonic ms
+
+	// running refresh
+	int					pending;	// queries in flight
+	int					got_v4;
+	int					got_v6;
+	int					ttl;		// s, lowest of the answers
+	int					hosts_tried;
+
+	struct dns_waiter	*waiters;
+	UT_hash_handle		hh;
+};
+
+// RFC 8305 connection race over the addresses of one host
+struct he_race {
+	struct bufferevent	*bev;	// referenced until the race ends
+	struct dns_entry	*dns;	// NULL for a literal address
+	int					fast;
+	int					naddr;
+	int					started;
+	int					error;
+	struct sockaddr_storage	addr[2];
+	evutil_socket_t		fd[2];
+	struct event		*ev[2];
+	struct event		*delay;
+};
+
+static struct dns_entry *dns_cache = NULL;
+static int tfo_unsupported = 0;
+
+static void he_start_next(struct he_race *race);
+
+// bufferevent_free() clears the callbacks but our reference keeps the
+// memory: that is how a connect finishing late knows nobody wants it
+static int
+bev_abandoned(struct bufferevent *bev)
+{
+	bufferevent_data_cb readcb, writecb;
+	bufferevent_event_cb eventcb;
+	bufferevent_getcb(bev, &readcb, &writecb, &eventcb, NULL);
+	return !readcb && !writecb && !eventcb;
+}
+
+static void
+he_finish(struct he_race *race, int winner)
+{
+	for (int i = 0; i < race->started; i++) {
+		if (race->ev[i])
+			event_free(race->ev[i]);
+		if (i != winner && race->fd[i] >= 0)
+			evutil_closesocket(race->fd[i]);
+	}
+	event_free(race->delay);
+
+	struct bufferevent *bev = race->bev;
+	if (bev_abandoned(bev)) {
+		if (winner >= 0)
+			evutil_closesocket(race->fd[winner]);
+	} else if (winner >= 0) {
+		if (race->dns)
+			race->dns->prefer_v4 = race->addr[winner].ss_family == AF_INET;
+		bufferevent_setfd(bev, race->fd[winner]);
+		bufferevent_trigger_event(bev, BEV_EVENT_CONNECTED, 0);
+	} else {
+		errno = race->error;
+		bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
+	}
+	bufferevent_decref(bev);
+	free(race);
+}
+
+// an attempt failed: start the next address now, or give up once
+// nothing is left in flight
+static void
+he_attempt_failed(struct he_race *race, int i, int error)
+{
+	if (race->ev[i]) {
+		event_free(race->ev[i]);
+		race->ev[i] = NULL;
+	}
+	if (race->fd[i] >= 0)
+		evutil_closesocket(race->fd[i]);
+	race->fd[i] = -1;
+	race->error = error;
+
+	if (race->started < race->naddr) {
+		he_start_next(race);
+		return;
+	}
+	for (int n = 0; n < race->started; n++) {
+		if (race->fd[n] >= 0)
+			return;
+	}
+	he_finish(race, -1);
+}
+
+static void
+he_connect_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct he_race *race = arg;
+	int i = race->fd[0] == fd ? 0 : 1;
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+
+	if (error)
+		he_attempt_failed(race, i, error);
+	else
+		he_finish(race, i);
+}
+
+static void
+he_start_next(struct he_race *race)
+{
+	int i = race->started++;
+	struct sockaddr *sa = (struct sockaddr *)&race->addr[i];
+	socklen_t len = sa->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+	race->fd[i] = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (race->fd[i] < 0) {
+		he_attempt_failed(race, i, errno);
+		return;
+	}
+	evutil_make_socket_nonblocking(race->fd[i]);
+	evutil_make_socket_closeonexec(race->fd[i]);
+
+#ifdef TCP_FASTOPEN_CONNECT
+	// connect() returns at once and the first write (NewWorkConn, or data
+	// for the local service) is carried in the SYN; without a cookie for
+	// the peer yet the kernel falls back to a normal handshake by itself
+	int on = 1;
+	if (race->fast && !tfo_unsupported &&
+		setsockopt(race->fd[i], IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0) {
+		debug(LOG_WARNING, "tcp fast open unavailable: %s", strerror(errno));
+		tfo_unsupported = 1;
+	}
+#endif
+
+	if (connect(race->fd[i], sa, len) == 0) {
+		he_finish(race, i);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		he_attempt_failed(race, i, errno);
+		return;
+	}
+
+	race->ev[i] = event_new(bufferevent_get_base(race->bev), race->fd[i], EV_WRITE, he_connect_cb, race);
+	event_add(race->ev[i], NULL);
+	if (race->started < race->naddr) {
+		struct timeval tv = {0, HE_ATTEMPT_DELAY * 1000};
+		evtimer_add(race->delay, &tv);
+	}
+}
+
+static void
+he_delay_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct he_race *race = arg;
+	if (bev_abandoned(race->bev))
+		he_finish(race, -1);
+	else if (race->started < race->naddr)
+		he_start_next(race);
+}
+
+static void
+he_add_addr(struct he_race *race, int family, const void *addr, int port)
+{
+	struct sockaddr_storage *ss = &race->addr[race->naddr++];
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+	}
+}
+
+// the first attempt runs from the loop too, so whatever it reports
+// reaches the callbacks the caller sets after connect_server() returns
+static void
+he_start(struct bufferevent *bev, struct dns_entry *dns, int family, const void *addr, int port, int fast)
+{
+	struct he_race *race = calloc(1, sizeof(struct he_race));
+	assert(race);
+	race->bev = bev;
+	race->dns = dns;
+	race->fast = fast;
+	race->fd[0] = race->fd[1] = -1;
+	race->delay = evtimer_new(bufferevent_get_base(bev), he_delay_cb, race);
+	bufferevent_incref(bev);
+
+	if (!dns) {
+		he_add_addr(race, family, addr, port);
+	} else {
+		// ipv6 first, unless ipv4 won the last time
+		int v6_first = dns->has_v6 && !(dns->prefer_v4 && dns->has_v4);
+		if (v6_first)
+			he_add_addr(race, AF_INET6, &dns->v6, port);
+		if (dns->has_v4)
+			he_add_addr(race, AF_INET, &dns->v4, port);
+		if (dns->has_v6 && !v6_first)
+			he_add_addr(race, AF_INET6, &dns->v6, port);
+	}
+	// a TFO connect() succeeds before any handshake, so the first family
+	// tried would always win: race plainly and keep TFO for single addresses
+	if (race->naddr > 1)
+		race->fast = 0;
+
+	struct timeval tv = {0, 0};
+	evtimer_add(race->delay, &tv);
+}
+
+static void dns_query_finished(struct dns_entry *e);
+
+static int
+dns_clamp_ttl(int ttl)
+{
+	if (ttl < DNS_MIN_TTL)
+		return DNS_MIN_TTL;
+	return ttl > DNS_MAX_TTL ? DNS_MAX_TTL : ttl;
+}
+
+static void
+dns_resolve_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	struct dns_entry *e = arg;
+	if (result == DNS_ERR_NONE && count > 0) {
+		if (type == DNS_IPv4_A) {
+			memcpy(&e->v4, addresses, sizeof(e->v4));
+			e->got_v4 = 1;
+		} else if (type == DNS_IPv6_AAAA) {
+			memcpy(&e->v6, addresses, sizeof(e->v6));
+			e->got_v6 = 1;
+		}
+		ttl = dns_clamp_ttl(ttl);
+		if (ttl < e->ttl)
+			e->ttl = ttl;
+	}
+	dns_query_finished(e);
+}
+
+// hosts file and search domain answers carry no ttl
+static void
+dns_hosts_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	struct dns_entry *e = arg;
+	for (struct evutil_addrinfo *ai = res; result == 0 && ai; ai = ai->ai_next) {
+		if (ai->ai_family == AF_INET && !e->got_v4) {
+			e->v4 = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+			e->got_v4 = 1;
+		} else if (ai->ai_family == AF_INET6 && !e->got_v6) {
+			e->v6 = ((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+			e->got_v6 = 1;
+		}
+	}
+	if (res)
+		evutil_freeaddrinfo(res);
+	dns_query_finished(e);
+}
+
+static void
+dns_refresh_done(struct dns_entry *e)
+{
+	uint64_t now = get_monotonic_ms();
+	if (e->got_v4 || e->got_v6) {
+		e->has_v4 = e->got_v4;
+		e->has_v6 = e->got_v6;
+		e->expire = now + e->ttl * 1000;
+	} else if (!e->hosts_tried && !e->has_v4 && !e->has_v6) {
+		struct evutil_addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		e->hosts_tried = 1;
+		e->ttl = DNS_HOSTS_TTL;
+		e->pending = 1;
+		evdns_getaddrinfo(main_ctl->dnsbase, e->name, NULL, &hints, dns_hosts_cb, e);
+		return;
+	} else {
+		// keep whatever was known and ask again soon
+		debug(LOG_WARNING, "resolve %s failed", e->name);
+		e->expire = now + DNS_MIN_TTL * 1000;
+	}
+	e->hosts_tried = 0;
+
+	struct dns_waiter *w = e->waiters;
+	e->waiters = NULL;
+	while (w) {
+		struct dns_waiter *next = w->next;
+		if (e->has_v4 || e->has_v6) {
+			he_start(w->bev, e, 0, NULL, w->port, w->fast);
+		} else if (!bev_abandoned(w->bev)) {
+			errno = EHOSTUNREACH;
+			bufferevent_trigger_event(w->bev, BEV_EVENT_ERROR, 0);
+		}
+		bufferevent_decref(w->bev);
+		free(w);
+		w = next;
+	}
+}
+
+static void
+dns_query_finished(struct dns_entry *e)
+{
+	if (--e->pending == 0)
+		dns_refresh_done(e);
+}
+
+static void
+dns_refresh(struct dns_entry *e)
+{
+	if (e->pending)
+		return;
+
+	e->got_v4 = e->got_v6 = 0;
+	e->ttl = DNS_MAX_TTL;
+	e->pending = 2;
+	if (!evdns_base_resolve_ipv4(main_ctl->dnsbase, e->name, 0, dns_resolve_cb, e))
+		dns_query_finished(e);
+	if (!evdns_base_resolve_ipv6(main_ctl->dnsbase, e->name, 0, dns_resolve_cb, e))
+		dns_query_finished(e);
+}
+
+// cached entry of name, refreshed in the background once it expired
+static struct dns_entry *
+dns_lookup(const char *name)
+{
+	struct dns_entry *e = NULL;
+	HASH_FIND_STR(dns_cache, name, e);
+	if (!e) {
+		e = calloc(1, sizeof(struct dns_entry));
+		assert(e);
+		e->name = strdup(name);
+		assert(e->name);
+		HASH_ADD_KEYPTR(hh, dns_cache, e->name, strlen(e->name), e);
+	}
+	if (get_monotonic_ms() >= e->expire)
+		dns_refresh(e);
+
+	return e;
+}
+
+static void
+dns_prefetch(const char *name)
+{
+	struct in6_addr addr;
+	if (!name || evutil_inet_pton(AF_INET, name, &addr) == 1 ||
+		evutil_inet_pton(AF_INET6, name, &addr) == 1)
+		return;
+
+	dns_lookup(name);
+}
+
+static void
+free_dns_cache()
+{
+	struct dns_entry *e, *tmp;
+	HASH_ITER(hh, dns_cache, e, tmp) {
+		HASH_DEL(dns_cache, e);
+		while (e->waiters) {
+			struct dns_waiter *w = e->waiters;
+			e->waiters = w->next;
+			bufferevent_decref(w->bev);
+			free(w);
+		}
+		free(e->name);
+		free(e);
+	}
+}
+
+static struct bufferevent *
+connect_host(struct event_base *base, const char *name, const int port, int fast)
 {
 	struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
 	assert(bev);
 
-	if (bufferevent_socket_connect_hostname(bev, main_ctl->dnsbase, 
-											AF_INET, name, port) < 0 ) {
-		bufferevent_free(bev);
-		return NULL;
+	struct in_addr v4;
+	struct in6_addr v6;
+	if (evutil_inet_pton(AF_INET, name, &v4) == 1) {
+		he_start(bev, NULL, AF_INET, &v4, port, fast);
+		return bev;
 	}
-	
+	if (evutil_inet_pton(AF_INET6, name, &v6) == 1) {
+		he_start(bev, NULL, AF_INET6, &v6, port, fast);
+		return bev;
+	}
+
+	struct dns_entry *e = dns_lookup(name);
+	if (e->has_v4 || e->has_v6) {
+		he_start(bev, e, 0, NULL, port, fast);
+		return bev;
+	}
+
+	struct dns_waiter *w = calloc(1, sizeof(struct dns_waiter));
+	assert(w);
+	w->bev = bev;
+	w->port = port;
+	w->fast = fast;
+	w->next = e->waiters;
+	e->waiters = w;
+	bufferevent_incref(bev);
+
 	return bev;
 }
 
+// addresses come from the resolver cache, and hosts with both ipv4 and
+// ipv6 addresses are raced; the result reaches the bev's event callback
+struct bufferevent *
+connect_server(struct event_base *base, const char *name, const int port)
+{
+	return connect_host(base, name, port, 0);
+}
+
+// like connect_server(), but with tcp_fast_open set the socket uses
+// TCP_FASTOPEN_CONNECT; if the option is unsupported, it is not retried
+struct bufferevent *
+connect_server_fast(struct event_base *base, const char *name, const int port)
+{
+	return connect_host(base, name, port, get_common_config()->tcp_fast_open);
+}
+
 static void 
 set_ticker_ping_timer(struct event *timeout)
 {
@@ -243,12 +767,11 @@ hb_sender_cb(evutil_socket_t fd, short event, void *arg)
 	set_ticker_ping_timer(main_ctl->ticker_ping);	
 	
 	struct common_conf 	*c_conf = get_common_config();
-	time_t current_time = time(NULL);
-	int interval = current_time - pong_time;
-	if (pong_time && interval > c_conf->heartbeat_timeout) {
-		debug(LOG_INFO, " interval [%d] greater than heartbeat_timeout [%d]", interval, c_conf->heartbeat_timeout);
-		clear_main_control();
-		run_control();
+	uint64_t interval = get_monotonic_ms() - pong_time;
+	if (pong_time && interval > (uint64_t)c_conf->heartbeat_timeout * 1000) {
+		debug(LOG_INFO, " interval [%d ms] greater than heartbeat_timeout [%d]", 
+						(int)interval, c_conf->heartbeat_timeout);
+		schedule_reconnect();
 		return;
 	}
 }
@@ -292,6 +815,8 @@ proxy_service_resp_raw(struct new_proxy_response *npr)
 			debug(LOG_ERR, "error: ftp remote_data_port [%d] that request from server is invalid!", npr->remote_port);
 			return 1;
 		}
+		if (main_ps->remote_data_port != npr->remote_port)
+			SAFE_FREE(main_ps->new_proxy_msg);
 		main_ps->remote_data_port = npr->remote_port;
 	}
 
@@ -356,7 +881,7 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 			start_proxy_services();
 			set_client_status(1);
 		}
-		new_client_connect();
+		handle_req_work_conn();
 		break;
 	case TypeNewProxyResp:
 		debug(LOG_DEBUG, "TypeNewProxyResp cmd ");
@@ -367,7 +892,10 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 		}
 
 		proxy_service_resp_raw(npr);
-		SAFE_FREE(npr);
+		new_proxy_resp_free(npr);
+		if (register_pending > 0 && --register_pending == 0)
+			debug(LOG_INFO, "%d proxies registered %u ms after connect", register_total, 
+							(unsigned)(get_monotonic_ms() - connect_time));
 		break;
 	case TypeStartWorkConn:
 		debug(LOG_DEBUG, "TypeStartWorkConn cmd");
@@ -401,13 +929,14 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 			client->data_tail = msg->data + msg_hton(msg->length);
 			debug(LOG_DEBUG, "data_tail is %s", client->data_tail); 
 		}
-		start_xfrp_tunnel(client);
+		// start_xfrp_tunnel() frees client when the local service is unreachable
 		set_client_work_start(client, 1);
+		start_xfrp_tunnel(client);
 
 		break;
 	case TypePong:
 		//debug(LOG_DEBUG, "receive pong from frps");
-		pong_time = time(NULL);
+		pong_time = get_monotonic_ms();
 		break;
 	default:
 		debug(LOG_INFO, "command type dont support: ctx is %d", ctx?1:0);
@@ -433,12 +962,19 @@ handle_login_response(const uint8_t *buf, int len)
 
 	if (!login_resp_check(lres)) {
 		debug(LOG_ERR, "login failed");	
-		free(lres);
+		login_resp_free(lres);
 		return 0;
 	}
-	free(lres);
+	login_resp_free(lres);
 	
 	is_login = 1;
+	main_ctl->reconnect_attempts = 0;
+	req_work_count = 0;
+	req_work_time = 0;
+
+	// work streams may now be opened on the extra mux sessions
+	for (int i = 1; i < main_ctl->nsession; i++)
+		open_mux_session(&main_ctl->sessions[i]);
 
 	int login_len = msg_hton(mhdr->length);
 	int ilen = len - login_len - sizeof(struct msg_hdr);
@@ -457,9 +993,17 @@ handle_login_response(const uint8_t *buf, int len)
 	// start proxy services must first send
 	start_proxy_services();
 	set_client_status(1);
-	debug(LOG_DEBUG, "TypeReqWorkConn cmd, msg :%s", &frps_cmd[8]);
-	assert (frps_cmd[0] == TypeReqWorkConn);
-	new_client_connect();
+
+	// frps asks for its pool_count work connections right behind the
+	// login response; answer each the way a later request is answered
+	for (size_t off = 0; off + sizeof(struct msg_hdr) <= (size_t)nret; ) {
+		struct msg_hdr *msg = (struct msg_hdr *)(frps_cmd + off);
+		debug(LOG_DEBUG, "cmd %c after login response", msg->type);
+		if (msg->type == TypeReqWorkConn)
+			handle_req_work_conn();
+		off += sizeof(struct msg_hdr) + msg_hton(msg->length);
+	}
+	free(frps_cmd);
 
 	return 1;
 }
@@ -475,6 +1019,96 @@ handle_frps_msg(uint8_t *buf, int len, void *ctx)
 	}	
 }
 
+// output to frps drained below the low watermark, let the mux
+// scheduler queue the next frames
+static void
+mux_send_cb(struct bufferevent *bev, void *ctx)
+{
+	tmux_sched_run((struct tmux_session *)ctx);
+}
+
+static void
+mux_recv_cb(struct bufferevent *bev, void *ctx)
+{
+	handle_tcp_mux_input((struct tmux_session *)ctx, handle_frps_msg);
+}
+
+// frames queued during one loop iteration leave in one write
+static void
+set_mux_session_bev(struct tmux_session *session, struct bufferevent *bev)
+{
+	session->bev = bev;
+	bufferevent_set_max_single_write(bev, TMUX_MAX_SINGLE_IO);
+	bufferevent_set_max_single_read(bev, TMUX_MAX_SINGLE_IO);
+	bufferevent_setwatermark(bev, EV_WRITE, TMUX_SCHED_LOWAT, 0);
+}
+
+static void
+close_mux_session(struct tmux_session *session)
+{
+	clear_session_proxy_client(session);
+	if (session->bev)
+		bufferevent_free(session->bev);
+	reset_tmux_session(session);
+}
+
+static void
+reopen_mux_session_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct tmux_session *session = arg;
+	if (is_login && !session->bev)
+		open_mux_session(session);
+}
+
+static void
+restart_mux_session(struct tmux_session *session)
+{
+	close_mux_session(session);
+
+	struct timeval tv = {TMUX_SESSION_RETRY, 0};
+	event_base_once(main_ctl->connect_base, -1, EV_TIMEOUT, 
+					reopen_mux_session_cb, session, &tv);
+}
+
+static void
+mux_session_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct tmux_session *session = ctx;
+	int index = session - main_ctl->sessions;
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		debug(LOG_ERR, "mux session %d to frps closed: %s", index, strerror(errno));
+		restart_mux_session(session);
+	} else if (what & BEV_EVENT_CONNECTED) {
+		debug(LOG_INFO, "mux session %d to frps connected", index);
+		session->ready = 1;
+		start_tmux_keepalive(session, restart_mux_session);
+	}
+}
+
+// control session stopped answering mux pings
+static void
+control_session_dead(struct tmux_session *session)
+{
+	schedule_reconnect();
+}
+
+static void
+open_mux_session(struct tmux_session *session)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct bufferevent *bev = connect_server(main_ctl->connect_base, 
+						c_conf->server_addr, c_conf->server_port);
+	if (!bev) {
+		debug(LOG_ERR, "mux session connect server [%s:%d] failed", 
+						c_conf->server_addr, c_conf->server_port);
+		return;
+	}
+
+	set_mux_session_bev(session, bev);
+	bufferevent_setcb(bev, mux_recv_cb, mux_send_cb, mux_session_event_cb, session);
+	bufferevent_enable(bev, EV_WRITE|EV_READ);
+}
+
 // ctx: if recv_cb was called by common control, ctx == NULL
 //		else ctx == client struct
 static void 
@@ -487,88 +1121,13 @@ recv_cb(struct bufferevent *bev, void *ctx)
 	}
 	
 	
-	struct common_conf 	*c_conf = get_common_config();
-	if (c_conf->tcp_mux) {
-		static struct tcp_mux_header tmux_hdr;
-		static uint32_t stream_len = 0;
-		while (len > 0) {
-				struct tmux_stream *cur = get_cur_stream();
-				size_t nr = 0;
-				if (!cur) {
-					memset(&tmux_hdr, 0, sizeof(tmux_hdr));
-					uint8_t *data = (uint8_t *)&tmux_hdr;
-					nr = bufferevent_read(bev, data, sizeof(tmux_hdr));
-					assert(nr == sizeof(tmux_hdr));
-					assert(validate_tcp_mux_protocol(&tmux_hdr) > 0);
-					len -= nr;
-					if (tmux_hdr.type == DATA) {
-						uint32_t stream_id = ntohl(tmux_hdr.stream_id);
-						stream_len = ntohl(tmux_hdr.length);
-						cur = get_stream_by_id(stream_id);
-						if (!cur)
-							debug(LOG_DEBUG, "stream_id is %d", stream_id);
-						assert(cur != NULL);
-						if (len == 0) {
-							set_cur_stream(cur);
-							break;
-						}
-						if (len >= stream_len) {
-							nr = tmux_read(bev, cur, stream_len);
-							assert(nr == stream_len);
-							len -= stream_len;
-						} else {
-							nr = tmux_read(bev, cur, len);
-							stream_len -= len;
-							assert(nr == len);
-							set_cur_stream(cur);
-							len -= nr;
-							break;	
-						} 
-					}
-				} else {
-					assert(tmux_hdr.type == DATA);
-					if (len >= stream_len ) {
-						nr = tmux_read(bev, cur, stream_len);
-						assert(nr == stream_len);
-						len -= stream_len;
-					} else {
-						nr = tmux_read(bev, cur, len);
-						stream_len -= len;
-						assert(nr == len);
-						len -= nr;
-						break;
-					}	
-				}
-
-				switch(tmux_hdr.type) {
-				case DATA:
-				case WINDOW_UPDATE:
-				{
-					handle_tcp_mux_stream(&tmux_hdr, handle_frps_msg);
-					break;
-				}
-				case PING:
-					handle_tcp_mux_ping(&tmux_hdr);
-					break;
-				case GO_AWAY:
-					handle_tcp_mux_go_away(&tmux_hdr);
-					break;
-				default:
-					debug(LOG_ERR, "impossible here!!!!");
-					exit(-1);
-				}
-
-				set_cur_stream(NULL);
-		}
-	} else {	
-		uint8_t *buf = calloc(len, 1);
-		assert(buf);
-		evbuffer_remove(input, buf, len);
+	// nul terminated: the json body is parsed as a string
+	uint8_t *buf = calloc(len + 1, 1);
+	assert(buf);
+	evbuffer_remove(input, buf, len);
 
-		handle_frps_msg(buf, len, ctx);
-		SAFE_FREE(buf);
-	}
-		
+	handle_frps_msg(buf, len, ctx);
+	SAFE_FREE(buf);
 
 	return;
 }
@@ -577,25 +1136,18 @@ static void
 connect_event_cb (struct bufferevent *bev, short what, void *ctx)
 {
 	struct common_conf 	*c_conf = get_common_config();
-	static int retry_times = 1;
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-		if (retry_times >= 100) {
-			debug(LOG_INFO, 
-				"have retry connect to xfrp server for %d times, exit?", 
-				retry_times);
-		}
-		sleep(2);
-		retry_times++;
 		debug(LOG_ERR, "error: connect server [%s:%d] failed %s", 
 				c_conf->server_addr, 
 				c_conf->server_port,
 				strerror(errno));
-		assert(0);
-		reset_session_id();
-		clear_main_control();
-		run_control();
+		schedule_reconnect();
 	} else if (what & BEV_EVENT_CONNECTED) {
-		retry_times = 0;
+		connect_time = get_monotonic_ms();
+		if (c_conf->tcp_mux) {
+			main_ctl->sessions[0].ready = 1;
+			start_tmux_keepalive(&main_ctl->sessions[0], control_session_dead);
+		}
 		send_window_update(bev, &main_ctl->stream, 0);
 		login();
 		
@@ -607,15 +1159,66 @@ static void
 keep_control_alive() 
 {
 	debug(LOG_DEBUG, "start keep_control_alive");
-	main_ctl->ticker_ping = evtimer_new(main_ctl->connect_base, hb_sender_cb, NULL);
+	if (!main_ctl->ticker_ping)
+		main_ctl->ticker_ping = evtimer_new(main_ctl->connect_base, hb_sender_cb, NULL);
 	if ( !main_ctl->ticker_ping) {
 		debug(LOG_ERR, "Ping Ticker init failed!");
 		return;
 	}
-	pong_time = time(NULL);
+	pong_time = get_monotonic_ms();
 	set_ticker_ping_timer(main_ctl->ticker_ping);
 }
 
+static void
+reconnect_cb(evutil_socket_t fd, short event, void *arg)
+{
+	run_control();
+}
+
+// equal jitter backoff: half of min(max, min * 2^attempts) plus a random
+// share of the other half, so clients cut off by an frps restart do not
+// all come back in the same instant
+static uint32_t
+next_reconnect_delay()
+{
+	struct common_conf *c_conf = get_common_config();
+	uint64_t base = (uint64_t)c_conf->reconnect_min_interval * 1000;
+	uint64_t cap = (uint64_t)c_conf->reconnect_max_interval * 1000;
+	for (int i = 0; i < main_ctl->reconnect_attempts && base < cap; i++)
+		base *= 2;
+	if (base > cap)
+		base = cap;
+	if (main_ctl->reconnect_attempts < 32)
+		main_ctl->reconnect_attempts++;
+
+	uint32_t r = 0;
+	evutil_secure_rng_get_bytes(&r, sizeof(r));
+	return base / 2 + (base / 2 ? r % (base / 2 + 1) : 0);
+}
+
+// tear down the control connection and connect again from a timer; the
+// event loop keeps serving every other connection meanwhile
+static void
+schedule_reconnect()
+{
+	clear_main_control();
+	if (main_ctl->connect_bev) {
+		bufferevent_free(main_ctl->connect_bev);
+		main_ctl->connect_bev = NULL;
+	}
+
+	if (!main_ctl->reconnect_event)
+		main_ctl->reconnect_event = evtimer_new(main_ctl->connect_base, reconnect_cb, NULL);
+	assert(main_ctl->reconnect_event);
+
+	uint32_t delay = next_reconnect_delay();
+	debug(LOG_INFO, "reconnect server [%s:%d] in %u ms, attempt %d", 
+					get_common_config()->server_addr, get_common_config()->server_port, 
+					delay, main_ctl->reconnect_attempts);
+	struct timeval tv = {delay / 1000, (delay % 1000) * 1000};
+	evtimer_add(main_ctl->reconnect_event, &tv);
+}
+
 static void 
 start_base_connect()
 {
@@ -629,12 +1232,20 @@ start_base_connect()
 	if ( ! main_ctl->connect_bev) {
 		debug(LOG_ERR, "error: connect server [%s:%d] failed: [%d: %s]", 
 						c_conf->server_addr, c_conf->server_port, errno, strerror(errno));
-		exit(0);
+		schedule_reconnect();
+		return;
 	}
 
 	debug(LOG_INFO, "connect server [%s:%d]...", c_conf->server_addr, c_conf->server_port);
 	bufferevent_enable(main_ctl->connect_bev, EV_WRITE|EV_READ);
-	bufferevent_setcb(main_ctl->connect_bev, recv_cb, NULL, connect_event_cb, NULL);
+	if (c_conf->tcp_mux) {
+		struct tmux_session *session = &main_ctl->sessions[0];
+		set_mux_session_bev(session, main_ctl->connect_bev);
+		bufferevent_setcb(main_ctl->connect_bev, mux_recv_cb, mux_send_cb, 
+						connect_event_cb, session);
+	} else {
+		bufferevent_setcb(main_ctl->connect_bev, recv_cb, NULL, connect_event_cb, NULL);
+	}
 }
 
 void 
@@ -652,6 +1263,56 @@ login()
 	SAFE_FREE(lg_msg);
 }
 
+// message header and body laid out in dst, which holds at least
+// msg_len + sizeof(struct msg_hdr) bytes
+static size_t
+pack_msg(uint8_t *dst, const enum msg_type type, const char *msg, const size_t msg_len)
+{
+	struct msg_hdr *req_msg = (struct msg_hdr *)dst;
+	req_msg->type = type;
+	req_msg->length = msg_hton((uint64_t)msg_len);
+	memcpy(req_msg->data, msg, msg_len);
+
+	return msg_len + sizeof(struct msg_hdr);
+}
+
+// a message is packed, and encrypted in place if enc, straight into the
+// space it is sent from: the bufferevent's output, or for tcp mux a
+// scratch buffer that tmux_write() frames from; nothing is allocated
+// once scratch has grown to the largest message
+static void
+write_msg_frp_server(struct bufferevent *bout, const enum msg_type type, 
+			const char *msg, const size_t msg_len, struct tmux_stream *stream, int enc)
+{
+	static uint8_t *scratch = NULL;
+	static size_t scratch_cap = 0;
+	size_t len = msg_len + sizeof(struct msg_hdr);
+
+	if (!get_common_config()->tcp_mux) {
+		struct evbuffer *out = bufferevent_get_output(bout);
+		struct evbuffer_iovec vec;
+		int n = evbuffer_reserve_space(out, len, &vec, 1);
+		assert(n == 1);
+		pack_msg(vec.iov_base, type, msg, msg_len);
+		if (enc)
+			encrypt_data_to(vec.iov_base, len, get_main_encoder(), vec.iov_base);
+		vec.iov_len = len;
+		evbuffer_commit_space(out, &vec, 1);
+		return;
+	}
+
+	if (scratch_cap < len) {
+		SAFE_FREE(scratch);
+		scratch_cap = len < 1024 ? 1024 : len;
+		scratch = malloc(scratch_cap);
+		assert(scratch);
+	}
+	pack_msg(scratch, type, msg, msg_len);
+	if (enc)
+		encrypt_data_to(scratch, len, get_main_encoder(), scratch);
+	tmux_write(bout, scratch, len, stream);
+}
+
 void 
 send_msg_frp_server(struct bufferevent *bev, 
 			 const enum msg_type type, 
@@ -667,24 +1328,9 @@ send_msg_frp_server(struct bufferevent *bev,
 	}
 	assert(bout);
 
-	
-
 	debug(LOG_DEBUG, "send plain msg ----> [%c: %s]", type, msg);
 	
-	size_t len = msg_len + sizeof(struct msg_hdr);
-	struct msg_hdr *req_msg = calloc(len, 1);
-	assert(req_msg);
-	req_msg->type = type;
-	req_msg->length = msg_hton((uint64_t)msg_len);
-	memcpy(req_msg->data, msg, msg_len);
-	
-	struct common_conf *c_conf = get_common_config();
-	if (c_conf->tcp_mux)
-		tmux_write(bout, (uint8_t *)req_msg, len, stream);
-	else
-		bufferevent_write(bout, (uint8_t *)req_msg, len);
-	
-	free(req_msg);
+	write_msg_frp_server(bout, type, msg, msg_len, stream, 0);
 }
 
 void 
@@ -703,12 +1349,6 @@ send_enc_msg_frp_server(struct bufferevent *bev,
 	assert(bout);
 
 	//debug(LOG_DEBUG, "send enc msg ----> [%c: %s]", type, msg);
-	
-	struct msg_hdr *req_msg = calloc(msg_len+sizeof(struct msg_hdr), 1);
-	assert(req_msg);
-	req_msg->type = type;
-	req_msg->length = msg_hton((uint64_t)msg_len);
-	memcpy(req_msg->data, msg, msg_len);
 
 	struct common_conf *c_conf = get_common_config();
 	if (get_main_encoder() == NULL) {
@@ -720,17 +1360,7 @@ send_enc_msg_frp_server(struct bufferevent *bev,
 			bufferevent_write(bout, coder->iv, 16);
 	}
 
-	uint8_t *enc_msg = NULL;
-	size_t olen = encrypt_data((uint8_t *)req_msg, msg_len+sizeof(struct msg_hdr), get_main_encoder(), &enc_msg);
-	assert(olen > 0);
-	//debug(LOG_DEBUG, "encrypt_data length %d", olen);
-	if (c_conf->tcp_mux)
-		tmux_write(bout, enc_msg, olen, stream);
-	else
-		bufferevent_write(bout, enc_msg, olen);
-
-	free(enc_msg);	
-	free(req_msg);
+	write_msg_frp_server(bout, type, msg, msg_len, stream, 1);
 }
 
 struct control *
@@ -766,17 +1396,51 @@ send_new_proxy(struct proxy_service *ps)
 		return;
 	}
 
-	char *new_proxy_msg = NULL;
-	int len = new_proxy_service_marshal(ps, &new_proxy_msg);
-	if ( ! new_proxy_msg) {
-		debug(LOG_ERR, "proxy service request marshal failed");
+	// only an ftp data port learned from frps changes it, which drops it
+	if (!ps->new_proxy_msg) {
+		ps->new_proxy_len = new_proxy_service_marshal(ps, &ps->new_proxy_msg);
+		if ( ! ps->new_proxy_msg) {
+			debug(LOG_ERR, "proxy service request marshal failed");
+			return;
+		}
+	}
+
+	debug(LOG_DEBUG, "control proxy client: [Type %d : proxy_name %s : msg_len %d]", 
+					TypeNewProxy, ps->proxy_name, ps->new_proxy_len);
+
+	send_enc_msg_frp_server(NULL, TypeNewProxy, ps->new_proxy_msg, ps->new_proxy_len, &main_ctl->stream);
+}
+
+static void
+send_close_proxy(struct proxy_service *ps)
+{
+	char *close_proxy_msg = NULL;
+	int len = close_proxy_marshal(ps->proxy_name, &close_proxy_msg);
+	if ( ! close_proxy_msg) {
+		debug(LOG_ERR, "close proxy request marshal failed");
 		return;
 	}
 
-	debug(LOG_DEBUG, "control proxy client: [Type %d : proxy_name %s : msg_len %d]", TypeNewProxy, ps->proxy_name, len);
+	send_enc_msg_frp_server(NULL, TypeCloseProxy, close_proxy_msg, len, &main_ctl->stream);
+	SAFE_FREE(close_proxy_msg);
+}
+
+// health check verdict on a proxy's local service: while it is down the
+// proxy is taken off frps, so users are refused there instead of piling
+// up work connections that can only fail
+void
+set_proxy_service_down(struct proxy_service *ps, int down)
+{
+	ps->local_down = down;
+	debug(down ? LOG_WARNING : LOG_INFO, "proxy [%s] local service [%s:%d] is %s", 
+					ps->proxy_name, ps->local_ip, ps->local_port, down ? "down" : "up");
+	if (!is_login)
+		return;
 
-	send_enc_msg_frp_server(NULL, TypeNewProxy, new_proxy_msg, len, &main_ctl->stream);
-	SAFE_FREE(new_proxy_msg);
+	if (down)
+		send_close_proxy(ps);
+	else
+		send_new_proxy(ps);
 }
 
 void 
@@ -799,36 +1463,58 @@ init_main_control()
 		exit(0);
 	}
 	main_ctl->connect_base = base;
+
+	main_ctl->nsession = c_conf->tcp_mux ? c_conf->tcp_mux_connections : 1;
+	main_ctl->sessions = calloc(main_ctl->nsession, sizeof(struct tmux_session));
+	assert(main_ctl->sessions);
+	for (int i = 0; i < main_ctl->nsession; i++)
+		init_tmux_session(&main_ctl->sessions[i]);
 	
 	if (c_conf->tcp_mux) {
-		init_tmux_stream(&main_ctl->stream, get_next_session_id(), INIT);
+		struct tmux_session *session = &main_ctl->sessions[0];
+		init_tmux_stream(&main_ctl->stream, get_next_session_id(session), INIT);
+		add_stream(session, &main_ctl->stream, NULL);
 	}
 
-	// if server_addr is ip, done control init.
-	if (is_valid_ip_address((const char *)c_conf->server_addr))
-		return;
-
-	dnsbase = evdns_base_new(base, 1);
+	dnsbase = evdns_base_new(base, 0);
 	if (! dnsbase) {
 		debug(LOG_ERR, "error: evdns base init failed!");
 		exit(0);
 	}
 	main_ctl->dnsbase = dnsbase;
 
+	// system resolvers first, the public ones only if there are none
+	if (evdns_base_resolv_conf_parse(dnsbase, DNS_OPTIONS_ALL, "/etc/resolv.conf") != 0 ||
+		evdns_base_count_nameservers(dnsbase) == 0) {
+		debug(LOG_INFO, "no usable resolv.conf, use public dns servers");
+		evdns_base_nameserver_ip_add(dnsbase, "180.76.76.76");		//BaiduDNS
+		evdns_base_nameserver_ip_add(dnsbase, "223.5.5.5");			//AliDNS
+		evdns_base_nameserver_ip_add(dnsbase, "223.6.6.6");			//AliDNS
+		evdns_base_nameserver_ip_add(dnsbase, "114.114.114.114");	//114DNS
+	}
+
 	evdns_base_set_option(dnsbase, "timeout", "1.0");
 
    	// thanks to the following article
     // http://www.wuqiong.info/archives/13/
     evdns_base_set_option(dnsbase, "randomize-case:", "0");		//TurnOff DNS-0x20 encoding
-    evdns_base_nameserver_ip_add(dnsbase, "180.76.76.76");		//BaiduDNS
-	evdns_base_nameserver_ip_add(dnsbase, "223.5.5.5");			//AliDNS
-    evdns_base_nameserver_ip_add(dnsbase, "223.6.6.6");			//AliDNS
-	evdns_base_nameserver_ip_add(dnsbase, "114.114.114.114");	//114DNS
+
+	// resolve frps and the local services before they are needed
+	dns_prefetch(c_conf->server_addr);
+	struct proxy_service *ps, *tmp;
+	HASH_ITER(hh, get_all_proxy_services(), ps, tmp) {
+		dns_prefetch(ps->local_ip);
+		for (int i = 0; i < ps->nbackend; i++)
+			dns_prefetch(ps->backends[i].ip);
+	}
 }
 
 static void 
 free_main_control()
 {
+	for (int i = 0; i < main_ctl->nsession; i++)
+		SAFE_FREE(main_ctl->sessions[i].slots);
+	SAFE_FREE(main_ctl->sessions);
 	SAFE_FREE(main_ctl);
 	main_ctl = NULL;
 }
@@ -838,11 +1524,25 @@ clear_main_control()
 {
 	assert(main_ctl);
 	if (main_ctl->ticker_ping) evtimer_del(main_ctl->ticker_ping);
-	if (main_ctl->tcp_mux_ping_event) evtimer_del(main_ctl->tcp_mux_ping_event);
-	clear_all_proxy_client();
+	for (int i = 1; i < main_ctl->nsession; i++)
+		close_mux_session(&main_ctl->sessions[i]);
+
+	struct tmux_session *session = &main_ctl->sessions[0];
+	if (get_common_config()->tcp_mux)
+		clear_session_proxy_client(session);
+	else
+		clear_session_idle_proxy_client(session);
+	reset_tmux_session(session);
+	if (get_common_config()->tcp_mux) {
+		// the control stream is opened again on the next connection
+		del_stream(session, main_ctl->stream.id);
+		init_tmux_stream(&main_ctl->stream, get_next_session_id(session), INIT);
+		add_stream(session, &main_ctl->stream, NULL);
+	}
 	free_evp_cipher_ctx();
 	set_client_status(0);
 	pong_time = 0;	
+	register_pending = 0;
 	is_login = 0;
 }
 
@@ -850,9 +1550,13 @@ void
 close_main_control()
 {
 	clear_main_control();
+	if (main_ctl->reconnect_event) evtimer_del(main_ctl->reconnect_event);
 
 	event_base_dispatch(main_ctl->connect_base);
+	crypto_offload_free();
+	free_key_cache();
 	evdns_base_free(main_ctl->dnsbase, 0);
+	free_dns_cache();
 	event_base_free(main_ctl->connect_base);
 
 	free_main_control();
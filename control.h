@@ -31,6 +31,12 @@
 #include "uthash.h"
 #include "msg.h"
 
+#define	WORK_POOL_HEADROOM	10	// frps work connection pool is pool_count + 10
+#define	DNS_MIN_TTL			5	// s, also how long a failed lookup is trusted
+#define	DNS_MAX_TTL			3600
+#define	DNS_HOSTS_TTL		60	// s, names answered by hosts file or search domains
+#define	HE_ATTEMPT_DELAY	250	// ms, happy eyeballs connection attempt delay
+
 struct proxy_client;
 struct bufferevent;
 struct event_base;
@@ -41,10 +47,15 @@ struct control {
 	struct evdns_base  	*dnsbase;
     struct bufferevent  *connect_bev;    	//main io evet buf
     struct event		*ticker_ping;    	//heartbeat timer
+	struct event		*reconnect_event;	//backoff timer after the control link is lost
+	int					reconnect_attempts;	//since the last successful login
 
-	struct event		*tcp_mux_ping_event;	
-	uint32_t			tcp_mux_ping_id;	
 	struct tmux_stream	stream;
+
+	// sessions[0] runs over connect_bev and carries the control stream,
+	// the others only carry work streams
+	struct tmux_session	*sessions;
+	int					nsession;
 };
 
 void connect_eventcb(struct bufferevent *bev, short events, void *ptr);
@@ -79,6 +90,9 @@ void control_process(struct proxy_client *client);
 
 void send_new_proxy(struct proxy_service *ps);
 
+void set_proxy_service_down(struct proxy_service *ps, int down);
+
 struct bufferevent *connect_server(struct event_base *base, const char *name, const int port);
+struct bufferevent *connect_server_fast(struct event_base *base, const char *name, const int port);
 
 #endif //_CONTROL_H_
@@ -29,8 +29,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <time.h>
 #include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <openssl/ssl.h>
 
 #include "fastpbkdf2.h"
@@ -39,6 +43,11 @@
 #include "common.h"
 #include "debug.h"
 
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define	EVP_CTRL_AEAD_GET_TAG	EVP_CTRL_GCM_GET_TAG
+#define	EVP_CTRL_AEAD_SET_TAG	EVP_CTRL_GCM_SET_TAG
+#endif
+
 static const char *default_salt = "frp";
 static const size_t block_size = 16;
 static struct frp_coder *main_encoder = NULL;
@@ -46,6 +55,53 @@ static struct frp_coder *main_decoder = NULL;
 static EVP_CIPHER_CTX *enc_ctx = NULL;
 static EVP_CIPHER_CTX *dec_ctx = NULL;
 
+// pbkdf2 results by token, salt and length; the token does not change,
+// so the control coders of every reconnect and the streams of every work
+// connection share a handful of entries
+struct derived_key {
+	char				*token;
+	char				*salt;
+	size_t				len;
+	uint8_t				key[32];
+	struct derived_key	*next;
+};
+static struct derived_key *key_cache = NULL;
+
+static void
+derive_key(const char *token, const char *salt, uint8_t *key, size_t len)
+{
+	assert(len <= sizeof(key_cache->key));
+	struct derived_key *k;
+	for (k = key_cache; k; k = k->next) {
+		if (k->len == len && strcmp(k->token, token) == 0 && strcmp(k->salt, salt) == 0)
+			break;
+	}
+	if (!k) {
+		k = calloc(1, sizeof(struct derived_key));
+		assert(k);
+		k->token = strdup(token);
+		k->salt = strdup(salt);
+		assert(k->token && k->salt);
+		k->len = len;
+		encrypt_key(token, strlen(token), salt, k->key, len);
+		k->next = key_cache;
+		key_cache = k;
+	}
+	memcpy(key, k->key, len);
+}
+
+void
+free_key_cache()
+{
+	while (key_cache) {
+		struct derived_key *k = key_cache;
+		key_cache = k->next;
+		free(k->token);
+		free(k->salt);
+		free(k);
+	}
+}
+
 static void
 free_frp_coder(struct frp_coder *coder)
 {
@@ -98,7 +154,7 @@ new_coder(const char *token, const char *salt)
 
 	enc->token = token ? strdup(token):strdup("\0");
 	enc->salt = strdup(salt);
-	encrypt_key(enc->token, strlen(enc->token), enc->salt, enc->key, block_size);
+	derive_key(enc->token, enc->salt, enc->key, block_size);
 	encrypt_iv(enc->iv, block_size);
 	return enc;
 }
@@ -199,75 +255,67 @@ encrypt_iv(unsigned char *iv_buf, size_t iv_len)
 	return iv_buf;
 }
 
-// using aes-128-cfb and nopadding
-size_t 
-encrypt_data(const uint8_t *src_data, size_t srclen, struct frp_coder *encoder, unsigned char **ret)
+static EVP_CIPHER_CTX *
+main_cipher_ctx(EVP_CIPHER_CTX **ctx, const struct frp_coder *c, int enc)
 {
-	uint8_t *intext = (uint8_t *)src_data;
-	assert(intext);
-	assert(encoder);
-	struct frp_coder *c = encoder;
-	int outlen = 0, tmplen = 0;
-	uint8_t *outbuf = NULL;
-	assert(c);
-
-	outbuf = calloc(srclen, 1);
-	assert(outbuf);
-	*ret = outbuf;
-
-	if (!enc_ctx) {
-		enc_ctx = EVP_CIPHER_CTX_new();
-		EVP_EncryptInit_ex(enc_ctx, EVP_aes_128_cfb(), NULL, c->key, c->iv);
+	if (!*ctx) {
+		*ctx = EVP_CIPHER_CTX_new();
+		assert(*ctx);
+		EVP_CipherInit_ex(*ctx, EVP_aes_128_cfb(), NULL, c->key, c->iv, enc);
 	}
-	EVP_CIPHER_CTX *ctx = enc_ctx;
+	return *ctx;
+}
 
-	if(!EVP_EncryptUpdate(ctx, outbuf, &tmplen, intext, (int)srclen)) {
+// aes-128-cfb, no padding: out gets exactly len bytes and may be in
+// itself, so callers can encrypt into space they already own
+size_t 
+encrypt_data_to(const uint8_t *in, size_t len, struct frp_coder *encoder, uint8_t *out)
+{
+	assert(in && out && encoder);
+	EVP_CIPHER_CTX *ctx = main_cipher_ctx(&enc_ctx, encoder, 1);
+	int outlen = 0;
+	if (!EVP_EncryptUpdate(ctx, out, &outlen, in, (int)len)) {
 		debug(LOG_ERR, "EVP_EncryptUpdate error!");
-		goto E_END;
+		return 0;
 	}
-	outlen += tmplen;
-	if(!EVP_EncryptFinal_ex(ctx, outbuf+tmplen, &tmplen)) {
-		debug(LOG_ERR, "EVP_EncryptFinal_ex error!");
-		goto E_END;
+
+	return outlen;
+}
+
+size_t 
+decrypt_data_to(const uint8_t *in, size_t len, struct frp_coder *decoder, uint8_t *out)
+{
+	assert(in && out && decoder);
+	EVP_CIPHER_CTX *ctx = main_cipher_ctx(&dec_ctx, decoder, 0);
+	int outlen = 0;
+	if (!EVP_DecryptUpdate(ctx, out, &outlen, in, (int)len)) {
+		debug(LOG_ERR, "EVP_DecryptUpdate error!");
+		return 0;
 	}
 
-	outlen += tmplen;
-E_END:
 	return outlen;
 }
 
+// the result should be free after using
 size_t 
-decrypt_data(const uint8_t *enc_data, size_t enclen, struct frp_coder *decoder, uint8_t **ret)
+encrypt_data(const uint8_t *src_data, size_t srclen, struct frp_coder *encoder, unsigned char **ret)
 {
-	uint8_t *inbuf = (uint8_t *)enc_data;
-	uint8_t *outbuf = calloc(enclen+1, 1);
-	struct frp_coder *c = decoder;
-	assert(inbuf);
+	uint8_t *outbuf = calloc(srclen, 1);
 	assert(outbuf);
 	*ret = outbuf;
-	assert(decoder);
-	
-	int outlen = 0, tmplen = 0;
-	if (!dec_ctx) {
-		dec_ctx= EVP_CIPHER_CTX_new();
-		EVP_DecryptInit_ex(dec_ctx, EVP_aes_128_cfb(), NULL, c->key, c->iv);
-	}
 
-	EVP_CIPHER_CTX *ctx = dec_ctx;
-	if(!EVP_DecryptUpdate(ctx, outbuf, &tmplen, inbuf, enclen)) {
-		debug(LOG_ERR, "EVP_DecryptUpdate error!");
-		goto D_END;
-	}
-	outlen += tmplen;
+	return encrypt_data_to(src_data, srclen, encoder, outbuf);
+}
 
-	if(!EVP_DecryptFinal_ex(ctx, outbuf+outlen, &tmplen)) {
-		debug(LOG_ERR, "EVP_DecryptFinal_ex error");
-		goto D_END;
-	}
-	outlen += tmplen;
+// the result should be free after using, it is nul terminated
+size_t 
+decrypt_data(const uint8_t *enc_data, size_t enclen, struct frp_coder *decoder, uint8_t **ret)
+{
+	uint8_t *outbuf = calloc(enclen+1, 1);
+	assert(outbuf);
+	*ret = outbuf;
 
-D_END:
-	return outlen;
+	return decrypt_data_to(enc_data, enclen, decoder, outbuf);
 }
 
 void 
@@ -278,3 +326,525 @@ free_encoder(struct frp_coder *encoder) {
 		free(encoder);
 	}
 }
+
+struct cipher_desc {
+	const char			*name;
+	const EVP_CIPHER	*(*evp)(void);
+	int					aead;
+};
+
+static struct cipher_desc ciphers[] = {
+	{"aes-128-cfb", EVP_aes_128_cfb, 0},
+	{"aes-128-gcm", EVP_aes_128_gcm, 1},
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+	{"chacha20-poly1305", EVP_chacha20_poly1305, 1},
+#endif
+};
+#define	NCIPHER	(sizeof(ciphers) / sizeof(ciphers[0]))
+
+// work connections use aes-128-cfb unless [common] work_cipher says otherwise
+static const struct cipher_desc *work_cipher = &ciphers[0];
+
+static const struct cipher_desc *
+find_cipher(const char *name)
+{
+	for (size_t i = 0; name && i < NCIPHER; i++) {
+		if (strcmp(ciphers[i].name, name) == 0)
+			return &ciphers[i];
+	}
+	return NULL;
+}
+
+// [common] work_cipher, NULL keeps aes-128-cfb. frps has no way to
+// agree on another cipher, so anything else only works against a frps
+// patched to match; -1 for a name not built in
+int
+set_work_cipher(const char *name)
+{
+	const struct cipher_desc *c = name ? find_cipher(name) : &ciphers[0];
+	if (!c)
+		return -1;
+
+	work_cipher = c;
+	if (work_cipher != &ciphers[0])
+		debug(LOG_WARNING, "work_cipher %s is experimental, stock frps only speaks %s", 
+						work_cipher->name, ciphers[0].name);
+	return 0;
+}
+
+// encrypt side is ready at once with a fresh iv, the decrypt side is
+// keyed once the peer's iv has been read off the stream
+struct crypto_stream *
+new_crypto_stream(const char *token, int encrypt)
+{
+	struct crypto_stream *cs = calloc(1, sizeof(struct crypto_stream));
+	assert(cs);
+	cs->encrypt = encrypt;
+	cs->cipher = work_cipher;
+	cs->ctx = EVP_CIPHER_CTX_new();
+	assert(cs->ctx);
+	if (!token)
+		token = "";
+	const EVP_CIPHER *evp = cs->cipher->evp();
+	derive_key(token, default_salt, cs->key, EVP_CIPHER_key_length(evp));
+
+	if (encrypt) {
+		evutil_secure_rng_get_bytes(cs->iv, block_size);
+		cs->iv_len = block_size;
+	} else if (cs->cipher->aead) {
+		cs->pending = evbuffer_new();
+		assert(cs->pending);
+	}
+
+	// aead ciphers get their nonce per record
+	if (cs->cipher->aead)
+		EVP_CipherInit_ex(cs->ctx, evp, NULL, cs->key, NULL, encrypt);
+	else if (encrypt)
+		EVP_CipherInit_ex(cs->ctx, evp, NULL, cs->key, cs->iv, 1);
+
+	return cs;
+}
+
+static void
+destroy_crypto_stream(struct crypto_stream *cs)
+{
+	if (cs->pending)
+		evbuffer_free(cs->pending);
+	EVP_CIPHER_CTX_free(cs->ctx);
+	free(cs);
+}
+
+// a worker may still be running the cipher, it goes with its last job
+void
+free_crypto_stream(struct crypto_stream *cs)
+{
+	if (!cs)
+		return;
+
+	if (cs->inflight)
+		cs->orphaned = 1;
+	else
+		destroy_crypto_stream(cs);
+}
+
+// drain up to len leading bytes of src as the peer's iv, return how many
+static size_t
+crypto_stream_take_iv(struct crypto_stream *cs, struct evbuffer *src, size_t len)
+{
+	size_t n = block_size - cs->iv_len;
+	if (n > len)
+		n = len;
+	evbuffer_remove(src, cs->iv + cs->iv_len, n);
+	cs->iv_len += n;
+	if (cs->iv_len == block_size && !cs->cipher->aead)
+		EVP_CipherInit_ex(cs->ctx, cs->cipher->evp(), NULL, cs->key, cs->iv, 0);
+
+	return n;
+}
+
+// run the cipher over the first len bytes of buf in place, chain by
+// chain, without copying them out
+static int
+crypto_stream_update(struct crypto_stream *cs, struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_ptr ptr;
+	evbuffer_ptr_set(buf, &ptr, 0, EVBUFFER_PTR_SET);
+	while (len > 0) {
+		struct evbuffer_iovec vec[8];
+		int n = evbuffer_peek(buf, len, &ptr, vec, 8);
+		if (n <= 0)
+			return 0;
+
+		for (int i = 0; i < n && i < 8 && len > 0; i++) {
+			size_t l = vec[i].iov_len < len ? vec[i].iov_len : len;
+			int outl = 0;
+			if (!EVP_CipherUpdate(cs->ctx, vec[i].iov_base, &outl, vec[i].iov_base, l)) {
+				debug(LOG_ERR, "EVP_CipherUpdate error!");
+				return 0;
+			}
+			len -= l;
+			evbuffer_ptr_set(buf, &ptr, l, EVBUFFER_PTR_ADD);
+		}
+	}
+	return 1;
+}
+
+// start an aead record: nonce from the iv and the record counter, and
+// the plain length header as additional data
+static void
+crypto_stream_record(struct crypto_stream *cs, const uint8_t *hdr)
+{
+	uint8_t nonce[12];
+	memcpy(nonce, cs->iv, sizeof(nonce));
+	for (int i = 0; i < 8; i++)
+		nonce[4 + i] ^= (uint8_t)(cs->seq >> (56 - 8 * i));
+	cs->seq++;
+
+	int outl = 0;
+	EVP_CipherInit_ex(cs->ctx, NULL, NULL, NULL, nonce, cs->encrypt);
+	EVP_CipherUpdate(cs->ctx, NULL, &outl, hdr, CIPHER_AEAD_HDR);
+}
+
+// bytes on the wire for plain bytes of payload
+size_t
+crypto_stream_wire_size(const struct crypto_stream *cs, size_t plain)
+{
+	if (!cs->cipher->aead)
+		return plain;
+
+	size_t records = (plain + CIPHER_AEAD_RECORD - 1) / CIPHER_AEAD_RECORD;
+	return plain + records * (CIPHER_AEAD_HDR + CIPHER_AEAD_TAG);
+}
+
+// most plain bytes whose sealed form fits in wire bytes
+size_t
+crypto_stream_plain_room(const struct crypto_stream *cs, size_t wire)
+{
+	if (!cs->cipher->aead)
+		return wire;
+
+	size_t overhead = CIPHER_AEAD_HDR + CIPHER_AEAD_TAG;
+	size_t full = wire / (CIPHER_AEAD_RECORD + overhead);
+	size_t rest = wire % (CIPHER_AEAD_RECORD + overhead);
+	return full * CIPHER_AEAD_RECORD + (rest > overhead ? rest - overhead : 0);
+}
+
+// move len plain bytes from the front of src to dst as ciphertext,
+// return the bytes added to dst
+size_t 
+crypto_stream_seal(struct crypto_stream *cs, struct evbuffer *src, size_t len, struct evbuffer *dst)
+{
+	if (!cs->cipher->aead) {
+		crypto_stream_update(cs, src, len);
+		evbuffer_remove_buffer(src, dst, len);
+		return len;
+	}
+
+	size_t wire = 0;
+	while (len > 0) {
+		size_t n = len < CIPHER_AEAD_RECORD ? len : CIPHER_AEAD_RECORD;
+		uint8_t hdr[CIPHER_AEAD_HDR] = {n >> 8, n & 0xff};
+		uint8_t tag[CIPHER_AEAD_TAG];
+		int outl = 0;
+
+		crypto_stream_record(cs, hdr);
+		crypto_stream_update(cs, src, n);
+		EVP_CipherFinal_ex(cs->ctx, tag, &outl);
+		EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag);
+
+		evbuffer_add(dst, hdr, sizeof(hdr));
+		evbuffer_remove_buffer(src, dst, n);
+		evbuffer_add(dst, tag, sizeof(tag));
+		wire += n + sizeof(hdr) + sizeof(tag);
+		len -= n;
+	}
+	return wire;
+}
+
+// take len bytes off the front of src and append what they decrypt to
+// to dst; aead records are only released once complete and verified.
+// return -1 once a record failed to authenticate, the stream is dead
+int 
+crypto_stream_open(struct crypto_stream *cs, struct evbuffer *src, size_t len, struct evbuffer *dst)
+{
+	if (cs->failed) {
+		evbuffer_drain(src, len);
+		return -1;
+	}
+	if (cs->iv_len < block_size)
+		len -= crypto_stream_take_iv(cs, src, len);
+
+	if (!cs->cipher->aead) {
+		crypto_stream_update(cs, src, len);
+		evbuffer_remove_buffer(src, dst, len);
+		return 0;
+	}
+
+	evbuffer_remove_buffer(src, cs->pending, len);
+	while (evbuffer_get_length(cs->pending) >= CIPHER_AEAD_HDR) {
+		uint8_t hdr[CIPHER_AEAD_HDR];
+		evbuffer_copyout(cs->pending, hdr, sizeof(hdr));
+		size_t n = (hdr[0] << 8) | hdr[1];
+		if (n == 0 || n > CIPHER_AEAD_RECORD) {
+			cs->failed = 1;
+			break;
+		}
+		if (evbuffer_get_length(cs->pending) < sizeof(hdr) + n + CIPHER_AEAD_TAG)
+			break;
+
+		uint8_t tag[CIPHER_AEAD_TAG];
+		int outl = 0;
+		evbuffer_drain(cs->pending, sizeof(hdr));
+		crypto_stream_record(cs, hdr);
+		crypto_stream_update(cs, cs->pending, n);
+		struct evbuffer_ptr ptr;
+		evbuffer_ptr_set(cs->pending, &ptr, n, EVBUFFER_PTR_SET);
+		evbuffer_copyout_from(cs->pending, &ptr, tag, sizeof(tag));
+		EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_AEAD_SET_TAG, sizeof(tag), tag);
+		if (EVP_CipherFinal_ex(cs->ctx, tag, &outl) <= 0) {
+			cs->failed = 1;
+			break;
+		}
+		evbuffer_remove_buffer(cs->pending, dst, n);
+		evbuffer_drain(cs->pending, sizeof(tag));
+	}
+
+	if (cs->failed) {
+		debug(LOG_ERR, "%s record failed to authenticate", cs->cipher->name);
+		evbuffer_drain(cs->pending, evbuffer_get_length(cs->pending));
+		return -1;
+	}
+	return 0;
+}
+
+// offload: large chunks are sealed and opened by worker threads. Each
+// stream sticks to one worker while it has jobs queued, so its cfb
+// keystream and aead records stay in order; idle streams go to the
+// least loaded worker. Workers hand finished jobs back on a lock-free
+// stack and wake the event loop through an eventfd
+struct crypto_job {
+	struct crypto_job		*next;
+	struct crypto_stream	*cs;
+	struct evbuffer			*in;
+	struct evbuffer			*out;
+	struct bufferevent		*dst;
+	crypto_fail_fn			fail;
+	void					*arg;
+	size_t					len;
+	int						ret;
+};
+
+struct crypto_worker {
+	pthread_t			tid;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct crypto_job	*head;		// submitted jobs, under lock
+	struct crypto_job	*tail;
+	int					quit;		// under lock
+	int					queued;		// main thread only
+};
+
+static struct crypto_worker *workers;
+static int nworkers;
+static struct crypto_job *done_jobs;	// pushed by workers, taken whole by the loop
+static int done_fd = -1;
+static struct event *done_event;
+
+static void
+crypto_job_done(struct crypto_job *job)
+{
+	struct crypto_job *head = __atomic_load_n(&done_jobs, __ATOMIC_RELAXED);
+	do {
+		job->next = head;
+	} while (!__atomic_compare_exchange_n(&done_jobs, &head, job, 1, 
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// the loop reads the eventfd before it takes the stack, so waking
+	// it on the first push is enough
+	if (!head) {
+		uint64_t one = 1;
+		if (write(done_fd, &one, sizeof(one)) < 0)
+			debug(LOG_ERR, "crypto worker wake: %s", strerror(errno));
+	}
+}
+
+static void *
+crypto_worker_run(void *arg)
+{
+	struct crypto_worker *w = arg;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->head && !w->quit)
+			pthread_cond_wait(&w->cond, &w->lock);
+		struct crypto_job *job = w->head;
+		if (job) {
+			w->head = job->next;
+			if (!w->head)
+				w->tail = NULL;
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (!job)
+			break;
+
+		size_t len = evbuffer_get_length(job->in);
+		if (job->cs->encrypt) {
+			crypto_stream_seal(job->cs, job->in, len, job->out);
+			job->ret = 0;
+		} else {
+			job->ret = crypto_stream_open(job->cs, job->in, len, job->out);
+		}
+		crypto_job_done(job);
+	}
+	return NULL;
+}
+
+static void
+crypto_job_finish(struct crypto_job *job)
+{
+	struct crypto_stream *cs = job->cs;
+	cs->inflight--;
+	cs->inflight_bytes -= job->len;
+	workers[cs->worker].queued--;
+	if (cs->orphaned) {
+		if (!cs->inflight)
+			destroy_crypto_stream(cs);
+	} else if (job->ret < 0) {
+		// may free the stream's owner
+		if (job->fail)
+			job->fail(job->arg);
+	} else {
+		evbuffer_add_buffer(bufferevent_get_output(job->dst), job->out);
+		// nothing left to write out, so no write callback would tell
+		// the owner its bytes are through (window, half close)
+		if (!evbuffer_get_length(bufferevent_get_output(job->dst)))
+			bufferevent_trigger(job->dst, EV_WRITE,
+						BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	bufferevent_decref(job->dst);
+	evbuffer_free(job->in);
+	evbuffer_free(job->out);
+	free(job);
+}
+
+static void
+crypto_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+	uint64_t n;
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		debug(LOG_ERR, "crypto done read: %s", strerror(errno));
+
+	// the stack gives jobs back newest first
+	struct crypto_job *list = __atomic_exchange_n(&done_jobs, NULL, __ATOMIC_ACQUIRE);
+	struct crypto_job *job = NULL;
+	while (list) {
+		struct crypto_job *next = list->next;
+		list->next = job;
+		job = list;
+		list = next;
+	}
+	while (job) {
+		struct crypto_job *next = job->next;
+		crypto_job_finish(job);
+		job = next;
+	}
+}
+
+// seal or open len bytes off the front of src into dst's output. Small
+// chunks are done here unless the stream already has jobs queued, which
+// they must not overtake. Return -1 when the stream failed to
+// authenticate here and now; a worker reports it through fail(arg)
+int
+crypto_stream_forward(struct crypto_stream *cs, struct evbuffer *src, size_t len, 
+					struct bufferevent *dst, crypto_fail_fn fail, void *arg)
+{
+	if (!nworkers || (len < CRYPTO_OFFLOAD_MIN && !cs->inflight)) {
+		if (!cs->encrypt)
+			return crypto_stream_open(cs, src, len, bufferevent_get_output(dst));
+		crypto_stream_seal(cs, src, len, bufferevent_get_output(dst));
+		return 0;
+	}
+
+	if (!cs->inflight) {
+		cs->worker = 0;
+		for (int i = 1; i < nworkers; i++) {
+			if (workers[i].queued < workers[cs->worker].queued)
+				cs->worker = i;
+		}
+	}
+
+	struct crypto_job *job = calloc(1, sizeof(struct crypto_job));
+	assert(job);
+	job->cs = cs;
+	job->in = evbuffer_new();
+	job->out = evbuffer_new();
+	assert(job->in && job->out);
+	evbuffer_remove_buffer(src, job->in, len);
+	job->dst = dst;
+	bufferevent_incref(dst);
+	job->fail = fail;
+	job->arg = arg;
+	job->len = len;
+
+	struct crypto_worker *w = &workers[cs->worker];
+	cs->inflight++;
+	cs->inflight_bytes += len;
+	w->queued++;
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = job;
+	else
+		w->head = job;
+	w->tail = job;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+void
+crypto_offload_init(struct event_base *base, int threads)
+{
+	if (threads <= 0 || nworkers)
+		return;
+
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (done_fd < 0) {
+		debug(LOG_ERR, "eventfd failed: %s, crypto stays inline", strerror(errno));
+		return;
+	}
+	done_event = event_new(base, done_fd, EV_READ | EV_PERSIST, crypto_done_cb, NULL);
+	assert(done_event);
+	event_add(done_event, NULL);
+
+	workers = calloc(threads, sizeof(struct crypto_worker));
+	assert(workers);
+
+	// signals belong to the event loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (; nworkers < threads; nworkers++) {
+		struct crypto_worker *w = &workers[nworkers];
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->tid, NULL, crypto_worker_run, w) != 0) {
+			debug(LOG_ERR, "crypto worker %d: %s", nworkers, strerror(errno));
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->cond);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	debug(LOG_INFO, "crypto offload on %d worker threads", nworkers);
+}
+
+// workers finish what they were given before they go
+void
+crypto_offload_free()
+{
+	if (!workers)
+		return;
+
+	for (int i = 0; i < nworkers; i++) {
+		struct crypto_worker *w = &workers[i];
+		pthread_mutex_lock(&w->lock);
+		w->quit = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->tid, NULL);
+	}
+	crypto_done_cb(done_fd, EV_READ, NULL);
+
+	for (int i = 0; i < nworkers; i++) {
+		pthread_mutex_destroy(&workers[i].lock);
+		pthread_cond_destroy(&workers[i].cond);
+	}
+	SAFE_FREE(workers);
+	nworkers = 0;
+	event_free(done_event);
+	done_event = NULL;
+	close(done_fd);
+	done_fd = -1;
+}
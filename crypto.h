@@ -32,8 +32,48 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <openssl/evp.h>
+
 #include "common.h"
 
+struct evbuffer;
+struct bufferevent;
+struct event_base;
+
+#define	CIPHER_AEAD_RECORD	(16*1024)	// plaintext bytes per aead record
+#define	CIPHER_AEAD_HDR		2			// record length, authenticated
+#define	CIPHER_AEAD_TAG		16
+#define	CRYPTO_MAX_THREADS	16
+#define	CRYPTO_OFFLOAD_MIN	(4*1024)	// smaller chunks are cheaper to do inline
+
+struct cipher_desc;
+
+// one direction of a use_encryption work connection. The sending side
+// puts a random iv in front of the stream. aes-128-cfb (what frps
+// speaks) then runs over the raw bytes; the experimental aead ciphers
+// cut the stream into records of length, ciphertext and tag, the nonce
+// being the iv with the record counter folded in
+struct crypto_stream {
+	EVP_CIPHER_CTX				*ctx;
+	const struct cipher_desc	*cipher;
+	uint8_t			iv[16];
+	int				iv_len;		// decrypt side: iv bytes received so far
+	int				encrypt;
+	int				failed;		// aead record did not authenticate
+	uint64_t		seq;		// aead records done
+	uint8_t			key[32];
+	struct evbuffer	*pending;	// aead decrypt side: incomplete record
+
+	// offload, main thread only
+	int				inflight;	// jobs queued on a worker
+	size_t			inflight_bytes;	// their input, not in dst yet
+	int				worker;		// that worker, fixed while inflight
+	int				orphaned;	// freed with jobs inflight, last one frees it
+};
+
+// a job failed to authenticate; arg is the one given with the job
+typedef void (*crypto_fail_fn)(void *arg);
+
 struct frp_coder {
 	uint8_t 	key[16];
 	char 		*salt;
@@ -51,10 +91,27 @@ struct frp_coder *new_coder(const char *token, const char *salt);
 uint8_t *encrypt_key(const char *token, size_t token_len, const char *salt, uint8_t *key, size_t key_len);
 uint8_t *encrypt_iv(uint8_t *iv_buf, size_t iv_len);
 size_t encrypt_data(const uint8_t *src_data, size_t srclen, struct frp_coder *encoder, uint8_t **ret);
+size_t encrypt_data_to(const uint8_t *in, size_t len, struct frp_coder *encoder, uint8_t *out);
+size_t decrypt_data_to(const uint8_t *in, size_t len, struct frp_coder *decoder, uint8_t *out);
 struct frp_coder *get_main_encoder();
 struct frp_coder *get_main_decoder();
 size_t get_block_size();
 void free_encoder(struct frp_coder *encoder);
 void free_evp_cipher_ctx();
+void free_key_cache();
+
+struct crypto_stream *new_crypto_stream(const char *token, int encrypt);
+void free_crypto_stream(struct crypto_stream *cs);
+size_t crypto_stream_seal(struct crypto_stream *cs, struct evbuffer *src, size_t len, struct evbuffer *dst);
+int crypto_stream_open(struct crypto_stream *cs, struct evbuffer *src, size_t len, struct evbuffer *dst);
+size_t crypto_stream_wire_size(const struct crypto_stream *cs, size_t plain);
+size_t crypto_stream_plain_room(const struct crypto_stream *cs, size_t wire);
+int crypto_stream_forward(struct crypto_stream *cs, struct evbuffer *src, size_t len, 
+						struct bufferevent *dst, crypto_fail_fn fail, void *arg);
+
+int set_work_cipher(const char *name);
+
+void crypto_offload_init(struct event_base *base, int threads);
+void crypto_offload_free();
 
 #endif // _CRYPTO_H_
@@ -87,7 +87,7 @@ void init_login()
 	c_login->timestamp 		= 0;
 	c_login->run_id 		= NULL;
 	c_login->metas			= NULL;
-	c_login->pool_count 	= 1;
+	c_login->pool_count 	= get_common_config()->pool_count;
 	c_login->privilege_key 	= NULL;
 
 	c_login->logged 		= 0;
@@ -245,6 +245,28 @@ new_work_conn_marshal(const struct work_conn *work_c, char **msg)
 	return nret;
 }
 
+int 
+close_proxy_marshal(const char *proxy_name, char **msg)
+{
+	const char *tmp = NULL;
+	int nret = 0;
+	struct json_object *j_close_proxy = json_object_new_object();
+	if (! j_close_proxy)
+		return 0;
+
+	JSON_MARSHAL_TYPE(j_close_proxy, "proxy_name", string, SAFE_JSON_STRING(proxy_name));
+	tmp = json_object_to_json_string(j_close_proxy);
+	if (tmp && strlen(tmp) > 0) {
+		nret = strlen(tmp);
+		*msg = strdup(tmp);
+		assert(*msg);
+	}
+
+	json_object_put(j_close_proxy);
+
+	return nret;
+}
+
 // result returned of this func need be free
 struct new_proxy_response *
 new_proxy_resp_unmarshal(const char *jres)
@@ -383,6 +405,30 @@ control_response_free(struct control_response *res)
 	SAFE_FREE(res);
 }
 
+void
+login_resp_free(struct login_resp *lr)
+{
+	if (!lr)
+		return;
+
+	SAFE_FREE(lr->version);
+	SAFE_FREE(lr->run_id);
+	SAFE_FREE(lr->error);
+	SAFE_FREE(lr);
+}
+
+void
+new_proxy_resp_free(struct new_proxy_response *npr)
+{
+	if (!npr)
+		return;
+
+	SAFE_FREE(npr->run_id);
+	SAFE_FREE(npr->proxy_name);
+	SAFE_FREE(npr->error);
+	SAFE_FREE(npr);
+}
+
 int 
 msg_type_valid_check(char msg_type)
 {
@@ -111,8 +111,11 @@ struct start_work_conn_resp *start_work_conn_resp_unmarshal(const char *resp_msg
 struct control_response *control_response_unmarshal(const char *jres);
 struct work_conn *new_work_conn();
 int new_work_conn_marshal(const struct work_conn *work_c, char **msg);
+int close_proxy_marshal(const char *proxy_name, char **msg);
 
 void control_response_free(struct control_response *res);
+void login_resp_free(struct login_resp *lr);
+void new_proxy_resp_free(struct new_proxy_response *npr);
 
 char *get_msg_type(uint8_t type);
 
@@ -47,6 +47,8 @@ void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name,
 	ps->local_ip = strdup(local_fp->ftp_server_ip);
 	assert(ps->local_ip);
 
+	if (ps->remote_port != remote_fp->ftp_server_port)
+		SAFE_FREE(ps->new_proxy_msg);
 	ps->remote_port = remote_fp->ftp_server_port;
 
 	debug(LOG_DEBUG, 
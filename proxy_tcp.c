@@ -46,6 +46,7 @@
 #include "proxy.h"
 #include "config.h"
 #include "tcpmux.h"
+#include "crypto.h"
 
 #define	BUF_LEN	2*1024
 
@@ -62,22 +63,29 @@ void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 	assert(len > 0);
 	if (!c_conf->tcp_mux) {
 		struct evbuffer *dst = bufferevent_get_output(partner);
-		evbuffer_add_buffer(dst, src);
+		if (client->enc)
+			crypto_stream_forward(client->enc, src, len, partner, NULL, NULL);
+		else
+			evbuffer_add_buffer(dst, src);
 		return;
 	}
 
-	uint8_t *buf = (uint8_t *)malloc(len);
-	assert(buf != NULL);
-	memset(buf, 0, len);
-	uint32_t nr = bufferevent_read(bev, buf, len);
-	assert(nr == len);
-	nr = tmux_write(partner, buf, len, &client->stream);
-	if (nr < len) {
-		debug(LOG_DEBUG, "stream_id [%d] tmux_write %d data, disable read", client->stream.id, nr);
+	// the scheduler frames src when this stream's turn comes; stop
+	// reading while a full frame is already waiting
+	tmux_stream_schedule(&client->stream);
+	if (evbuffer_get_length(src) >= TMUX_SCHED_FRAME) {
+		debug(LOG_DEBUG, "stream_id [%d] has %d bytes queued, disable read", 
+						client->stream.id, evbuffer_get_length(src));
 		bufferevent_disable(bev, EV_READ);
 	}
 }
 
+static void
+tcp_proxy_crypto_fail(void *arg)
+{
+	del_proxy_client(arg);
+}
+
 // read data from frps
 // when tcp mux enable this function will not be used
 void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
@@ -91,5 +99,10 @@ void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
 	size_t len = evbuffer_get_length(src);
 	assert(len > 0);
 	dst = bufferevent_get_output(partner);
-	evbuffer_add_buffer(dst, src);
+	if (!client->dec) {
+		evbuffer_add_buffer(dst, src);
+	} else if (crypto_stream_forward(client->dec, src, len, partner, 
+									tcp_proxy_crypto_fail, client) < 0) {
+		del_proxy_client(client);
+	}
 }
@@ -33,16 +33,39 @@
 #include "config.h"
 #include "debug.h"
 #include "control.h"
+#include "utils.h"
+#include "crypto.h"
 
 static uint8_t proto_version = 0;
-static uint8_t remote_go_away;
-static uint8_t local_go_away;
-static uint32_t g_session_id = 1;
-static struct tmux_stream *cur_stream = NULL;
-static struct tmux_stream *all_stream;
+
+// process_flags() result; after FLAGS_FREED the stream is gone
+enum flags_result {
+	FLAGS_ERR = 0,
+	FLAGS_OK,
+	FLAGS_FREED,
+};
 
 static uint32_t ring_buffer_read(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len);
-static uint32_t ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len);
+static void ring_buffer_release(struct ring_buffer *ring);
+static int ring_buffer_peek(struct ring_buffer *ring, uint32_t len, struct evbuffer_iovec *vec);
+static void ring_buffer_consume(struct ring_buffer *ring, uint32_t len);
+static void sched_unlink(struct tmux_stream *stream);
+static void tmux_stream_unblock(struct tmux_stream *stream);
+static struct bufferevent *stream_local_bev(struct tmux_stream *stream);
+static int stream_local_pending(struct tmux_stream *stream);
+static int stream_idle(struct tmux_stream *stream);
+static void stream_poke_local(struct tmux_stream *stream);
+
+// ring buffer pool: size classes RBUF_MIN_SIZE << i, up to RBUF_SIZE
+#define	RBUF_POOL_CLASSES	4
+#define	RBUF_POOL_MAX_FREE	16
+
+struct rbuf_chunk {
+	struct rbuf_chunk *next;
+};
+
+static struct rbuf_chunk *rbuf_pool[RBUF_POOL_CLASSES];
+static uint32_t rbuf_pool_free[RBUF_POOL_CLASSES];
 
 static struct tcp_mux_type_desc type_desc[] = {
 	{DATA, "data"},
@@ -81,70 +104,111 @@ flag_2_desc(enum tcp_mux_flag flag)
 	return "unkown_flag";
 }
 
-static int
-valid_tcp_mux_flag(uint16_t flag)
+static inline struct tmux_slot *
+stream_slot(struct tmux_session *session, uint32_t id)
 {
-	for(int i = 0; i < sizeof(flag_desc)/sizeof(struct tcp_mux_flag_desc); i++){
-		if (flag == flag_desc[i].flag)
-			return 1;
-	}
-	return 0;
+	return &session->slots[(id >> 1) & (session->slot_cap - 1)];
 }
 
-static int
-valid_tcp_mux_type(uint8_t type)
+// double the table; live ids never collide after rehash since they
+// already had distinct slots modulo the smaller capacity
+static void
+grow_stream_slots(struct tmux_session *session)
 {
-	if (type >= DATA && type <= GO_AWAY)
-		return 1;
-
-	return 0;
+	uint32_t old_cap = session->slot_cap;
+	struct tmux_slot *old = session->slots;
+
+	session->slot_cap = old_cap ? old_cap << 1 : STREAM_SLOT_MIN;
+	session->slots = calloc(session->slot_cap, sizeof(struct tmux_slot));
+	assert(session->slots);
+	for (uint32_t i = 0; i < old_cap; i++) {
+		if (old[i].stream)
+			*stream_slot(session, old[i].id) = old[i];
+	}
+	SAFE_FREE(old);
 }
 
-static int
-valid_tcp_mux_sid(uint32_t sid)
+void
+add_stream(struct tmux_session *session, struct tmux_stream *stream, struct proxy_client *pc)
 {
-	if (sid == 1)
-		return 1;
-	
-	return get_proxy_client(sid)?1:0;
+	if ((session->slot_used + 1) * 2 > session->slot_cap)
+		grow_stream_slots(session);
+
+	struct tmux_slot *slot = stream_slot(session, stream->id);
+	while (slot->stream && slot->id != stream->id) {
+		grow_stream_slots(session);
+		slot = stream_slot(session, stream->id);
+	}
+	if (!slot->stream)
+		session->slot_used++;
+
+	slot->id = stream->id;
+	slot->stream = stream;
+	slot->pc = pc;
+	stream->session = session;
 }
 
 void
-add_stream(struct tmux_stream *stream)
+del_stream(struct tmux_session *session, uint32_t id) 
 {
-	HASH_ADD_INT(all_stream, id, stream);	
+	if (!session->slots) return;
+
+	struct tmux_slot *slot = stream_slot(session, id);
+	if (slot->stream && slot->id == id) {
+		sched_unlink(slot->stream);
+		memset(slot, 0, sizeof(struct tmux_slot));
+		session->slot_used--;
+	}
 }
 
-void
-del_stream(uint32_t id) 
+// the stored id tells a live stream from a stale one reusing its slot
+struct tmux_slot *
+get_stream_slot(struct tmux_session *session, uint32_t id)
 {
-	assert(all_stream != NULL);
+	if (!session->slots) return NULL;
 
-	struct tmux_stream *stream = get_stream_by_id(id);
-	if (stream)
-		HASH_DEL(all_stream, stream);
+	struct tmux_slot *slot = stream_slot(session, id);
+	if (!slot->stream || slot->id != id)
+		return NULL;
+
+	return slot;
 }
 
 struct tmux_stream *
-get_stream_by_id(uint32_t id)
+get_stream_by_id(struct tmux_session *session, uint32_t id)
 {
-	if (!all_stream) return NULL;
+	struct tmux_slot *slot = get_stream_slot(session, id);
+	return slot ? slot->stream : NULL;
+}
 
-	struct tmux_stream *stream = NULL;
-	HASH_FIND_INT(all_stream, &id, stream);
-	return stream;
+void
+foreach_stream_client(struct tmux_session *session, void (*fn)(struct proxy_client *))
+{
+	for (uint32_t i = 0; i < session->slot_cap; i++) {
+		if (session->slots[i].pc)
+			fn(session->slots[i].pc);
+	}
 }
 
-struct tmux_stream *
-get_cur_stream() 
+void
+init_tmux_session(struct tmux_session *session)
 {
-	return cur_stream;
+	memset(session, 0, sizeof(struct tmux_session));
+	session->next_id = 1;
 }
 
+// forget connection state; live streams, such as the control stream,
+// keep their slots
 void
-set_cur_stream(struct tmux_stream *stream) 
+reset_tmux_session(struct tmux_session *session)
 {
-	cur_stream = stream;
+	stop_tmux_keepalive(session);
+	memset(&session->parser, 0, sizeof(session->parser));
+	session->next_id = 1;
+	session->remote_go_away = 0;
+	session->local_go_away = 0;
+	session->bev = NULL;
+	session->ready = 0;
 }
 
 void 
@@ -152,15 +216,32 @@ init_tmux_stream(struct tmux_stream *stream, uint32_t id, enum tcp_mux_state sta
 {
 	stream->id = id;
 	stream->state = state;
+	release_tmux_stream_buffer(stream);
+
 	stream->recv_window = MAX_STREAM_WINDOW_SIZE;
 	stream->send_window = MAX_STREAM_WINDOW_SIZE;
+	stream->max_recv_window = MAX_STREAM_WINDOW_SIZE;
+	stream->rtt = 0;
+	stream->syn_time = 0;
+	stream->win_update_time = 0;
 	
 	memset(&stream->tx_ring, 0, sizeof(struct ring_buffer));
 	memset(&stream->rx_ring, 0, sizeof(struct ring_buffer));
 
-	add_stream(stream);
+	stream->sched_next = stream->sched_prev = NULL;
+	stream->quantum = stream->deficit = 0;
+	stream->sched_active = 0;
+	stream->fin_pending = 0;
+	stream->session = NULL;
 };
 
+void
+release_tmux_stream_buffer(struct tmux_stream *stream)
+{
+	ring_buffer_release(&stream->tx_ring);
+	ring_buffer_release(&stream->rx_ring);
+}
+
 int
 validate_tcp_mux_protocol(struct tcp_mux_header *tmux_hdr)
 {
@@ -189,59 +270,78 @@ tcp_mux_flag()
 	return c_conf->tcp_mux;
 }
 
-static void
-dump_tcp_mux_header(uint8_t *data, int len)
-{
-	if (len != 12)
-		return;
-
-	printf("tcp mux header is : \n");
-	for (int i = 0; i < len; i++)
-		printf("%2x", data[i]);
-	printf("\n");
+// ids stay increasing; skip any whose slot is held by a long lived stream
+uint32_t 
+get_next_session_id(struct tmux_session *session) {
+	uint32_t id = session->next_id;
+	while (session->slots && stream_slot(session, id)->stream)
+		id += 2;
+	session->next_id = id + 2;
+	return id;
 }
 
-static uint32_t
-parse_tcp_mux_proto(uint8_t *data, int len, uint32_t *flag, uint32_t *type, uint32_t *stream_id, uint32_t *dlen)
+// copy len bytes of src into the reserved vectors at (*idx, *off)
+static void
+iovec_fill(struct evbuffer_iovec *vec, int *idx, size_t *off, const void *src, size_t len)
 {
-	struct common_conf *c_conf = get_common_config();
-	if (!c_conf->tcp_mux)
-		return 0;	
-
-	if (len < sizeof(struct tcp_mux_header))
-		return 0;
-
-	struct tcp_mux_header *hdr = (struct tcp_mux_header *)data;
-	if(hdr->version == proto_version && 
-	   valid_tcp_mux_type(hdr->type) &&
-	   valid_tcp_mux_flag(htons(hdr->flags))) {
-		if (hdr->type == DATA && !valid_tcp_mux_sid(htonl(hdr->stream_id))) {
-			debug(LOG_INFO, "!!!!!type is DATA but cant find stream_id : type [%s] flag [%s] stream_id[%d]", 
-				type_2_desc(hdr->type), flag_2_desc(htons(hdr->flags)), htonl(hdr->stream_id));
-			dump_tcp_mux_header(data, len);
-			exit(-1);
+	const uint8_t *p = src;
+	while (len > 0) {
+		size_t room = vec[*idx].iov_len - *off;
+		if (room == 0) {
+			(*idx)++;
+			*off = 0;
+			continue;
 		}
-		*type = hdr->type;
-		*flag = htons(hdr->flags);
-		*stream_id = htonl(hdr->stream_id);
-		*dlen = htonl(hdr->length);
-		return 1;
+		size_t n = len < room ? len : room;
+		memcpy((uint8_t *)vec[*idx].iov_base + *off, p, n);
+		*off += n;
+		p += n;
+		len -= n;
 	}
-
-	return 0;
 }
 
-
-void
-reset_session_id() {
-	g_session_id = 1;
+// header and payload pieces are laid out in one reservation of the
+// output buffer instead of one bufferevent_write() each, so a frame
+// normally ends up in a single chain
+static void
+tcp_mux_write_frame(struct bufferevent *bout, struct tcp_mux_header *tmux_hdr, 
+				struct evbuffer_iovec *payload, int npayload)
+{
+	struct evbuffer *out = bufferevent_get_output(bout);
+	size_t total = sizeof(struct tcp_mux_header);
+	for (int i = 0; i < npayload; i++)
+		total += payload[i].iov_len;
+
+	struct evbuffer_iovec vec[2];
+	int n = evbuffer_reserve_space(out, total, vec, 2);
+	assert(n > 0);
+
+	int idx = 0;
+	size_t off = 0;
+	iovec_fill(vec, &idx, &off, tmux_hdr, sizeof(struct tcp_mux_header));
+	for (int i = 0; i < npayload; i++)
+		iovec_fill(vec, &idx, &off, payload[i].iov_base, payload[i].iov_len);
+
+	if (off == 0) {
+		n = idx;
+	} else {
+		vec[idx].iov_len = off;
+		n = idx + 1;
+	}
+	evbuffer_commit_space(out, vec, n);
 }
 
-uint32_t 
-get_next_session_id() {
-	uint32_t id = g_session_id;
-	g_session_id += 2;
-	return id;
+static void
+tcp_mux_write_data_frame(struct bufferevent *bout, uint16_t flags, uint32_t stream_id, 
+				struct evbuffer_iovec *payload, int npayload)
+{
+	uint32_t length = 0;
+	for (int i = 0; i < npayload; i++)
+		length += payload[i].iov_len;
+
+	struct tcp_mux_header tmux_hdr;
+	tcp_mux_encode(DATA, flags, stream_id, length, &tmux_hdr);
+	tcp_mux_write_frame(bout, &tmux_hdr, payload, npayload);
 }
 
 static void
@@ -250,7 +350,7 @@ tcp_mux_send_win_update(struct bufferevent *bout, enum tcp_mux_flag flags, uint3
 	struct tcp_mux_header tmux_hdr;
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(WINDOW_UPDATE, flags, stream_id, delta, &tmux_hdr);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_write_frame(bout, &tmux_hdr, NULL, 0);
 }
 
 void
@@ -293,7 +393,7 @@ tcp_mux_send_data(struct bufferevent *bout, uint16_t flags, uint32_t stream_id,
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(DATA, flags, stream_id, length, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux [%d] send data len : %d", stream_id, length);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_write_frame(bout, &tmux_hdr, NULL, 0);
 }
 
 void 
@@ -305,7 +405,7 @@ tcp_mux_send_ping(struct bufferevent *bout, uint32_t ping_id)
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(PING, SYN, 0, ping_id, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping syn : %d", ping_id);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_write_frame(bout, &tmux_hdr, NULL, 0);
 }
 
 static void 
@@ -317,7 +417,7 @@ tcp_mux_handle_ping(struct bufferevent *bout, uint32_t ping_id)
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(PING, ACK, 0, ping_id, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping ack : %d", ping_id);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_write_frame(bout, &tmux_hdr, NULL, 0);
 }
 
 static void
@@ -329,42 +429,59 @@ tcp_mux_send_go_away(struct bufferevent *bout, uint32_t reason)
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(GO_AWAY, 0, 0, reason, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping ack : %d", ping_id);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_write_frame(bout, &tmux_hdr, NULL, 0);
 
 }
 
-static int
+static enum flags_result
 process_flags(uint16_t flags, struct tmux_stream *stream)
 {
 	uint32_t close_stream = 0;
 	if ( (flags&ACK) == ACK ) {
-		if (stream->state == SYN_SEND)
+		if (stream->state == SYN_SEND) {
 			stream->state = ESTABLISHED;
+			stream->rtt = get_monotonic_ms() - stream->syn_time;
+		}
 	} else if ( (flags&FIN) == FIN ) {
 		switch(stream->state) {
 		case SYN_SEND:
 		case SYN_RECEIVED:
 		case ESTABLISHED:
+			// a pooled stream frps drops before starting work on it has
+			// nothing to flush: answer the FIN and free the idle client
+			if (stream_idle(stream)) {
+				if (stream->session->bev)
+					tcp_mux_send_win_update_fin(stream->session->bev, stream->id);
+				stream->state = CLOSED;
+				close_stream = 1;
+				break;
+			}
+			// the local side gets EOF once it has all the data
 			stream->state = REMOTE_CLOSE;
+			stream_poke_local(stream);
 			break;
 		case LOCAL_CLOSE:
+			// if the local service is still taking what frps sent before
+			// its FIN, the local write callback frees the client later
 			stream->state = CLOSED;
-			close_stream = 1;
+			close_stream = !stream_local_pending(stream);
 			break;
 		default:
 			debug(LOG_ERR, "unexpected FIN flag in state %d", stream->state);
 			assert(0);
-			return 0;
+			return FLAGS_ERR;
 		}
 	} else if ( (flags&RST) == RST ) {
 		stream->state = RESET;
 		close_stream = 1;
 	}
 
-	if (close_stream)
-		del_proxy_client_by_stream_id(stream->id);
+	if (close_stream) {
+		del_proxy_client_by_stream(stream);
+		return FLAGS_FREED;
+	}
 
-	return 1;
+	return FLAGS_OK;
 }
 
 static uint16_t
@@ -376,6 +493,7 @@ get_send_flags(struct tmux_stream *stream)
 	case INIT:
 		flags |= SYN;
 		stream->state = SYN_SEND;
+		stream->syn_time = get_monotonic_ms();
 		break;			
 	case SYN_RECEIVED:
 		flags |= ACK;
@@ -388,10 +506,42 @@ get_send_flags(struct tmux_stream *stream)
 	return flags;
 }
 
+// if half of the window drained within two round trips the peer is
+// limited by our window rather than by the link, so double it
+static uint32_t
+tune_recv_window(struct tmux_stream *stream)
+{
+	uint64_t now = get_monotonic_ms();
+	uint64_t elapsed = now - stream->win_update_time;
+	uint32_t max = stream->max_recv_window;
+	uint32_t ceiling = get_common_config()->tcp_mux_max_window;
+	uint32_t rtt = stream->rtt;
+	if (stream->session && stream->session->srtt)
+		rtt = stream->session->srtt;
+
+	if (rtt && stream->win_update_time && 
+		elapsed < 2 * rtt && max < ceiling) {
+		max = max > ceiling/2 ? ceiling : max*2;
+		debug(LOG_DEBUG, "stream %d recv window grow to %u, rtt %u ms", 
+						stream->id, max, rtt);
+		stream->max_recv_window = max;
+
+		// the local service is asked back once half of it is written
+		struct bufferevent *local = stream_local_bev(stream);
+		if (local)
+			bufferevent_setwatermark(local, EV_WRITE, max / 2, 0);
+	}
+	stream->win_update_time = now;
+
+	return max;
+}
+
+// length: bytes received on the stream that the local side has not
+// taken yet, they stay out of the window until it does
 void
 send_window_update(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length)
 {
-	uint32_t max = MAX_STREAM_WINDOW_SIZE;
+	uint32_t max = stream->max_recv_window;
 	uint32_t delta = (max - length) - stream->recv_window;
 
 	uint16_t flags = get_send_flags(stream);	
@@ -399,12 +549,151 @@ send_window_update(struct bufferevent *bout, struct tmux_stream *stream, uint32_
 	if (delta < max/2 && flags == 0)
 		return;
 
+	if (flags == 0) {
+		max = tune_recv_window(stream);
+		delta = (max - length) - stream->recv_window;
+	}
+
 	stream->recv_window += delta;
 	tcp_mux_send_win_update(bout, flags, stream->id, delta);
 	debug(LOG_DEBUG, "send window update: flags %d, stream_id %d delta %d, recv_window %u length", 
 					flags, stream->id, delta, stream->recv_window, length);
 }
 
+// smallest pool class able to hold size bytes
+static int
+rbuf_class(uint32_t size)
+{
+	int cls = 0;
+	while ((RBUF_MIN_SIZE << cls) < size && cls < RBUF_POOL_CLASSES - 1)
+		cls++;
+
+	return cls;
+}
+
+static uint8_t *
+rbuf_pool_get(int cls)
+{
+	struct rbuf_chunk *chunk = rbuf_pool[cls];
+	if (chunk) {
+		rbuf_pool[cls] = chunk->next;
+		rbuf_pool_free[cls]--;
+		return (uint8_t *)chunk;
+	}
+
+	uint8_t *data = (uint8_t *)malloc(RBUF_MIN_SIZE << cls);
+	assert(data);
+	return data;
+}
+
+static void
+rbuf_pool_put(uint8_t *data, uint32_t cap)
+{
+	int cls = rbuf_class(cap);
+	if (rbuf_pool_free[cls] >= RBUF_POOL_MAX_FREE) {
+		free(data);
+		return;
+	}
+
+	struct rbuf_chunk *chunk = (struct rbuf_chunk *)data;
+	chunk->next = rbuf_pool[cls];
+	rbuf_pool[cls] = chunk;
+	rbuf_pool_free[cls]++;
+}
+
+static void
+ring_buffer_release(struct ring_buffer *ring)
+{
+	if (ring->data)
+		rbuf_pool_put(ring->data, ring->cap);
+
+	memset(ring, 0, sizeof(struct ring_buffer));
+}
+
+// contiguous readable bytes starting at ring->cur
+static uint32_t
+ring_buffer_data_span(struct ring_buffer *ring)
+{
+	uint32_t span = ring->cap - ring->cur;
+	return span < ring->sz ? span : ring->sz;
+}
+
+// describe the first len buffered bytes (at most two spans) without
+// consuming them
+static int
+ring_buffer_peek(struct ring_buffer *ring, uint32_t len, struct evbuffer_iovec *vec)
+{
+	if (len > ring->sz)
+		len = ring->sz;
+
+	int n = 0;
+	uint32_t pos = ring->cur;
+	while (len > 0) {
+		uint32_t span = ring->cap - pos;
+		if (span > len) span = len;
+		vec[n].iov_base = &ring->data[pos];
+		vec[n].iov_len = span;
+		n++;
+		len -= span;
+		pos = 0;
+	}
+
+	return n;
+}
+
+// contiguous writable bytes starting at ring->end
+static uint32_t
+ring_buffer_free_span(struct ring_buffer *ring)
+{
+	uint32_t left = ring->cap - ring->sz;
+	uint32_t span = ring->cap - ring->end;
+	return span < left ? span : left;
+}
+
+// make room for len more bytes, moving to a bigger class if needed
+static void
+ring_buffer_reserve(struct ring_buffer *ring, uint32_t len)
+{
+	uint32_t need = ring->sz + len;
+	assert(need <= RBUF_SIZE);
+	if (ring->data && need <= ring->cap)
+		return;
+
+	int cls = rbuf_class(need);
+	uint8_t *data = rbuf_pool_get(cls);
+	uint32_t sz = ring->sz;
+	if (ring->data) {
+		uint32_t span = ring_buffer_data_span(ring);
+		memcpy(data, &ring->data[ring->cur], span);
+		memcpy(data + span, ring->data, sz - span);
+		rbuf_pool_put(ring->data, ring->cap);
+	}
+
+	ring->data = data;
+	ring->cap = RBUF_MIN_SIZE << cls;
+	ring->cur = 0;
+	ring->end = sz;
+	ring->sz = sz;
+}
+
+static void
+ring_buffer_produce(struct ring_buffer *ring, uint32_t len)
+{
+	ring->end += len;
+	if (ring->end == ring->cap) ring->end = 0;
+	ring->sz += len;
+}
+
+static void
+ring_buffer_consume(struct ring_buffer *ring, uint32_t len)
+{
+	ring->cur += len;
+	if (ring->cur == ring->cap) ring->cur = 0;
+	ring->sz -= len;
+	if (ring->sz == 0)
+		ring_buffer_release(ring);
+}
+
 static int
 ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len)
 {
@@ -412,69 +701,100 @@ ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len)
 	assert(data != NULL);
 	
 	uint32_t i = 0;
-	while(i < len) {
-		data[i] = ring->data[ring->cur++];
-		if (ring->cur == RBUF_SIZE)
-			ring->cur = 0;
-		i++;
-		ring->sz--;
+	while (i < len) {
+		uint32_t span = ring_buffer_data_span(ring);
+		if (span > len - i) span = len - i;
+		memcpy(data + i, &ring->data[ring->cur], span);
+		ring_buffer_consume(ring, span);
+		i += span;
 	}
 
 	assert(i == len);
 	return len;
 }
 
+// stream bytes the local service has not taken yet: its unwritten
+// output, and what is still being decrypted on a crypto worker
+static uint32_t
+local_buffered(struct proxy_client *pc)
+{
+	if (!pc || !pc->local_proxy_bev)
+		return 0;
+
+	uint32_t buffered = evbuffer_get_length(bufferevent_get_output(pc->local_proxy_bev));
+	if (pc->dec)
+		buffered += pc->dec->inflight_bytes;
+	return buffered;
+}
+
+// return -1 on a protocol error; a RST, or the FIN that completes a
+// close, frees the stream and its payload already went to the local side
 static int
 process_data(struct tmux_stream *stream, uint32_t length, uint16_t flags, 
 				void (*fn)(uint8_t *, int, void *), void *param)
 {
-	if (!process_flags(flags, stream)) return 0;
-
+	enum flags_result r = process_flags(flags, stream);
+	if (r == FLAGS_ERR)
+		return -1;
+	if (r == FLAGS_FREED)
+		return length;
 
 	if (length > stream->recv_window) {
 		debug(LOG_ERR, "receive window exceed (remain %d, recv %d)", stream->recv_window, length);
-		return 0;
+		return -1;
 	}
 	
 	stream->recv_window -= length;
 
+	// payload of an established worker stream was already moved into
+	// its local service by tmux_read(), only messages sit in rx_ring
 	struct proxy_client *pc = (struct proxy_client *)param;
 	if (!pc || (pc && !pc->local_proxy_bev)) {
-		uint8_t *data = (uint8_t *)calloc(length, 1);
+		struct tmux_session *session = stream->session;
+		uint32_t id = stream->id;
+		// nul terminated: the json body is parsed as a string
+		uint8_t *data = (uint8_t *)calloc(length + 1, 1);
 		ring_buffer_pop(&stream->rx_ring, data, length);
 		fn(data, length, pc);
 		free(data);
-	} else {
-		ring_buffer_write(pc->local_proxy_bev, &stream->rx_ring, length);
+
+		// a StartWorkConn whose local service is down or unreachable
+		// resets the stream and frees it with its client
+		struct tmux_slot *slot = get_stream_slot(session, id);
+		if (!slot || slot->stream != stream)
+			return length;
 	}
-	
-	struct bufferevent *bout = get_main_control()->connect_bev;
-	send_window_update(bout, stream, length);	
+
+	if (stream->state == CLOSED)
+		return length;
+
+	// what the local service has not read yet holds the window back,
+	// tmux_stream_drained() gives it back as it is written out
+	send_window_update(stream->session->bev, stream, local_buffered(pc));
 
 	return length;
 }
 
-static int
-incr_send_window(struct bufferevent *bev, struct tcp_mux_header *tmux_hdr, uint16_t flags, struct tmux_stream *stream)
+static enum flags_result
+incr_send_window(struct tcp_mux_header *tmux_hdr, uint16_t flags, struct tmux_stream *stream)
 {
-	if (!process_flags(flags, stream))
-		return 0;
+	enum flags_result r = process_flags(flags, stream);
+	if (r != FLAGS_OK)
+		return r;
 	
 	uint32_t length = ntohl(tmux_hdr->length);
-	if (stream->send_window == 0) bufferevent_enable(bev, EV_READ);
 	stream->send_window += length;
 	//debug(LOG_DEBUG, "incr_send_window : stream_id %d length %d send_window %d", 
 	//				stream->id, length, stream->send_window);
 
-	return 1;
+	return FLAGS_OK;
 }
 
 static int
-incoming_stream(uint32_t stream_id)
+incoming_stream(struct tmux_session *session, uint32_t stream_id)
 {
-	if (local_go_away) {
-		struct bufferevent *bout = get_main_control()->connect_bev;
-		tcp_mux_send_win_update_rst(bout, stream_id);
+	if (session->local_go_away) {
+		tcp_mux_send_win_update_rst(session->bev, stream_id);
 		return 0;
 	}
 	
@@ -483,25 +803,127 @@ incoming_stream(uint32_t stream_id)
 	return 1;
 }
 
+static void
+update_session_rtt(struct tmux_session *session, uint32_t rtt)
+{
+	if (session->srtt == 0) {
+		session->srtt = rtt ? rtt : 1;
+		session->rttvar = rtt / 2;
+	} else {
+		uint32_t err = rtt > session->srtt ? rtt - session->srtt : session->srtt - rtt;
+		session->rttvar = (3 * session->rttvar + err) / 4;
+		session->srtt = (7 * session->srtt + rtt) / 8;
+		if (session->srtt == 0) session->srtt = 1;
+	}
+
+	uint32_t rto = session->srtt + 4 * session->rttvar;
+	if (rto < TMUX_MIN_RTO) rto = TMUX_MIN_RTO;
+	if (rto > TMUX_MAX_RTO) rto = TMUX_MAX_RTO;
+	session->rto = rto;
+}
+
 void
-handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr)
+handle_tcp_mux_ping(struct tmux_session *session, struct tcp_mux_header *tmux_hdr)
 {
 	uint16_t flags = ntohs(tmux_hdr->flags);
 	uint32_t ping_id = ntohl(tmux_hdr->length);
 
 	if ( (flags&SYN) == SYN) {
-		struct bufferevent *bout = get_main_control()->connect_bev;
-		tcp_mux_handle_ping(bout, ping_id);
+		tcp_mux_handle_ping(session->bev, ping_id);
+		return;
+	}
+
+	if ( (flags&ACK) != ACK)
+		return;
+
+	// any answer shows the session is alive, only the outstanding ping
+	// gives an RTT sample
+	session->ping_missed = 0;
+	if (!session->ping_id || ping_id != session->ping_id)
+		return;
+
+	update_session_rtt(session, get_monotonic_ms() - session->ping_time);
+	session->ping_id = 0;
+	debug(LOG_DEBUG, "mux ping %u: srtt %u ms rttvar %u ms rto %u ms", 
+					ping_id, session->srtt, session->rttvar, session->rto);
+
+	struct timeval tv = {get_common_config()->tcp_mux_keepalive_interval, 0};
+	evtimer_add(session->ping_event, &tv);
+}
+
+// next ping goes out keepalive_interval after an ack. While one is
+// outstanding no other is sent: each RTO that passes without anything
+// received from frps doubles the RTO, and TMUX_PING_MAX_MISSED of them
+// in a row declare the connection dead
+static void
+tmux_keepalive_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct tmux_session *session = arg;
+	if (session->ping_id) {
+		session->ping_missed++;
+		debug(LOG_INFO, "mux ping %u not answered in %u ms, missed %d", 
+						session->ping_id, session->rto, session->ping_missed);
+		if (session->ping_missed >= TMUX_PING_MAX_MISSED) {
+			debug(LOG_ERR, "mux session is dead after %d missed pings", session->ping_missed);
+			session->ping_id = 0;
+			session->dead_cb(session);
+			return;
+		}
+		session->rto = session->rto * 2 > TMUX_MAX_RTO ? TMUX_MAX_RTO : session->rto * 2;
+		struct timeval tv = {session->rto / 1000, (session->rto % 1000) * 1000};
+		evtimer_add(session->ping_event, &tv);
+		return;
 	}
+
+	session->ping_id = ++session->last_ping_id;
+	if (session->ping_id == 0)
+		session->ping_id = session->last_ping_id = 1;
+	session->ping_time = get_monotonic_ms();
+	tcp_mux_send_ping(session->bev, session->ping_id);
+
+	struct timeval tv = {session->rto / 1000, (session->rto % 1000) * 1000};
+	evtimer_add(session->ping_event, &tv);
+}
+
+void
+start_tmux_keepalive(struct tmux_session *session, void (*dead_cb)(struct tmux_session *))
+{
+	if (get_common_config()->tcp_mux_keepalive_interval <= 0 || !session->bev)
+		return;
+
+	stop_tmux_keepalive(session);
+	session->ping_event = evtimer_new(bufferevent_get_base(session->bev), 
+						tmux_keepalive_cb, session);
+	assert(session->ping_event);
+	session->dead_cb = dead_cb;
+	session->ping_missed = 0;
+	if (!session->rto)
+		session->rto = TMUX_MIN_RTO;
+
+	// first ping right away gives window tuning an RTT early
+	tmux_keepalive_cb(-1, 0, session);
 }
 
 void
-handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr)
+stop_tmux_keepalive(struct tmux_session *session)
+{
+	if (session->ping_event) {
+		evtimer_del(session->ping_event);
+		event_free(session->ping_event);
+		session->ping_event = NULL;
+	}
+	session->ping_id = 0;
+	session->ping_missed = 0;
+	session->srtt = session->rttvar = session->rto = 0;
+}
+
+void
+handle_tcp_mux_go_away(struct tmux_session *session, struct tcp_mux_header *tmux_hdr)
 {
 	uint32_t code = ntohl(tmux_hdr->length);
 	switch(code) {
 	case NORMAL:
-		remote_go_away = 1;
+		session->remote_go_away = 1;
 		break;
 	case PROTO_ERR:
 		debug(LOG_ERR, "receive protocol error go away");	
@@ -514,16 +936,50 @@ handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr)
 	}
 }
 
+// a record that fails to authenticate ends the stream; the rest of its
+// data is dropped until frps acks the FIN
+static void
+tmux_crypto_fail(void *arg)
+{
+	struct proxy_client *pc = arg;
+	if (pc->stream.fin_pending)
+		return;
+
+	bufferevent_disable(pc->local_proxy_bev, EV_READ);
+	tmux_stream_close(&pc->stream);
+}
+
 uint32_t
 tmux_read(struct bufferevent *bev, struct tmux_stream *stream, uint32_t len)
 {
 	assert(stream != NULL);
 
+	struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+	struct proxy_client *pc = slot ? slot->pc : NULL;
+	if (pc && pc->local_proxy_bev) {
+		// hand the DATA payload chains straight to the local service
+		struct evbuffer *src = bufferevent_get_input(bev);
+		struct evbuffer *dst = bufferevent_get_output(pc->local_proxy_bev);
+		if (pc->local_shut) {
+			// the local connection broke, frps learns from our FIN
+			evbuffer_drain(src, len);
+			return len;
+		}
+		if (pc->dec) {
+			if (crypto_stream_forward(pc->dec, src, len, pc->local_proxy_bev, 
+									tmux_crypto_fail, pc) < 0)
+				tmux_crypto_fail(pc);
+			return len;
+		}
+		int nr = evbuffer_remove_buffer(src, dst, len);
+		return nr > 0 ? nr : 0;
+	}
+
 	return ring_buffer_read(bev, &stream->rx_ring, len);
 }
 
 int
-handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
+handle_tcp_mux_stream(struct tmux_session *session, struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
 {
 	uint32_t stream_id = ntohl(tmux_hdr->stream_id);
 	uint16_t flags = ntohs(tmux_hdr->flags);
@@ -532,27 +988,35 @@ handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
 
 	if ( (flags&SYN) == SYN) {
 		debug(LOG_INFO, "!!!! as xfrpc, it should not be here %d", stream_id);
-		if (!incoming_stream(stream_id))
+		if (!incoming_stream(session, stream_id))
 			return 0;
 	}
 
-	struct tmux_stream *stream = get_stream_by_id(stream_id);
-	struct proxy_client *pc = get_proxy_client(stream_id);
-	assert(stream != NULL);	
+	struct tmux_slot *slot = get_stream_slot(session, stream_id);
+	if (!slot) {
+		// frames may still be in flight for a stream we already closed
+		debug(LOG_INFO, "stream_id %d not found, drop %s", stream_id, type_2_desc(tmux_hdr->type));
+		return 0;
+	}
+	struct tmux_stream *stream = slot->stream;
+	struct proxy_client *pc = slot->pc;
 	if (tmux_hdr->type == WINDOW_UPDATE) {
-		struct bufferevent *bev = pc?pc->local_proxy_bev: get_main_control()->connect_bev;
-		if (!incr_send_window(bev, tmux_hdr, flags, stream)) {
-			struct bufferevent *bout = get_main_control()->connect_bev;
-			tcp_mux_send_go_away(bout, PROTO_ERR);
+		// unscheduled with data left means the window was too small
+		uint32_t blocked = !stream->sched_active;
+		enum flags_result r = incr_send_window(tmux_hdr, flags, stream);
+		if (r == FLAGS_ERR) {
+			tcp_mux_send_go_away(session->bev, PROTO_ERR);
+			return 0;
 		}
+		if (r == FLAGS_OK && blocked)
+			tmux_stream_unblock(stream);
 		return 0;
 	}
 	
 	
 	int32_t length = ntohl(tmux_hdr->length);
-	if (!process_data(stream, length, flags, fn, (void *)pc)) {
-		struct bufferevent *bout = get_main_control()->connect_bev;
-		tcp_mux_send_go_away(bout, PROTO_ERR);
+	if (process_data(stream, length, flags, fn, (void *)pc) < 0) {
+		tcp_mux_send_go_away(session->bev, PROTO_ERR);
 		return 0;
 	}
 
@@ -564,14 +1028,17 @@ ring_buffer_append(struct ring_buffer *ring, uint8_t *data, uint32_t len)
 {
 	uint32_t left = RBUF_SIZE - ring->sz;	
 	assert(left >= len);
-	int i = 0;
-	for (; i < len; i++) {
-		ring->data[ring->end++] = data[i];
-		if (ring->end == RBUF_SIZE) ring->end = 0;
-		ring->sz++;
-		if (ring->cur == ring->end) {
-			break;
-		}
+	if (len == 0)
+		return 0;
+
+	ring_buffer_reserve(ring, len);
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t span = ring_buffer_free_span(ring);
+		if (span > len - i) span = len - i;
+		memcpy(&ring->data[ring->end], data + i, span);
+		ring_buffer_produce(ring, span);
+		i += span;
 	}
 
 	return i;
@@ -591,44 +1058,26 @@ ring_buffer_read(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len
 		len = cap;
 	}
 
-	for (int i = 0; i < len; i++) {
-		bufferevent_read(bev, &ring->data[ring->end++], 1);
-		if (ring->end == RBUF_SIZE) ring->end = 0;
-		ring->sz++;
-		if (ring->cur == ring->end) {
-			break;
-		}
-	}
-
-	return len;
-
-}
-
-static uint32_t
-ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len)
-{
-	if (ring->sz == 0) {
-		debug(LOG_ERR, "ring buffer is empty");
+	if (len == 0)
 		return 0;
-	}
-	
-	if (len > ring->sz) {
-		debug(LOG_INFO, "prepare write data [%d] out size ring data [%d]", len, ring->sz);
-		len = ring->sz;
-	}
 
-	while(len > 0) {
-		bufferevent_write(bev, &ring->data[ring->cur++], 1);
-		len--;
-		ring->sz--;;
-		if (ring->cur == RBUF_SIZE) ring->cur = 0;
-		if (ring->cur == ring->end) {
-			assert(ring->sz == 0);
+	// at most two reads: up to the wrap point, then from the start
+	ring_buffer_reserve(ring, len);
+	uint32_t nr = 0;
+	while (nr < len) {
+		uint32_t span = ring_buffer_free_span(ring);
+		if (span > len - nr) span = len - nr;
+		size_t n = bufferevent_read(bev, &ring->data[ring->end], span);
+		ring_buffer_produce(ring, n);
+		nr += n;
+		if (n < span)
 			break;
-		}
 	}
 
-	return len;
+	if (ring->sz == 0)
+		ring_buffer_release(ring);
+
+	return nr;
 }
 
 uint32_t 
@@ -657,181 +1106,432 @@ tmux_write(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_
 	}
 
 	uint16_t flags = get_send_flags(stream);
-	uint32_t max = length;
-	struct bufferevent *bout = get_main_control()->connect_bev;
 	//debug(LOG_DEBUG, "tmux_write stream id %u: send_window %u tx_ring sz %u length %u", 
 	//				stream->id, stream->send_window, tx_ring->sz, length);
-	if (stream->send_window < tx_ring->sz) {
-		debug(LOG_INFO, " send_window %u less than tx_ring size %u", stream->send_window, tx_ring->sz);
-		max = stream->send_window;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		ring_buffer_write(bev, tx_ring, max);
-		ring_buffer_append(tx_ring, data, length);
-	} else if (stream->send_window < tx_ring->sz + length) {
-		debug(LOG_INFO, " send_window %u less than  %u", stream->send_window, tx_ring->sz+length);
+	uint32_t max = tx_ring->sz + length;
+	if (stream->send_window < max) {
+		debug(LOG_INFO, " send_window %u less than  %u", stream->send_window, max);
 		max = stream->send_window;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		if (tx_ring->sz > 0)
-			ring_buffer_write(bev, tx_ring, tx_ring->sz);
-		bufferevent_write(bev, data, max - tx_ring->sz);
-		ring_buffer_append(tx_ring, data + max - tx_ring->sz, length + tx_ring->sz - max);
-	} else {
-		max = tx_ring->sz + length;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		if (tx_ring->sz > 0)
-			ring_buffer_write(bev, tx_ring, tx_ring->sz);
-		bufferevent_write(bev, data, length);
 	}
+
+	// parked bytes go first, then as much of data as the window allows
+	struct evbuffer_iovec payload[3];
+	int n = ring_buffer_peek(tx_ring, max, payload);
+	uint32_t from_ring = 0;
+	for (int i = 0; i < n; i++)
+		from_ring += payload[i].iov_len;
+	uint32_t from_data = max - from_ring;
+	if (from_data > 0) {
+		payload[n].iov_base = data;
+		payload[n].iov_len = from_data;
+		n++;
+	}
+
+	tcp_mux_write_data_frame(bev, flags, stream->id, payload, n);
+	if (from_ring > 0)
+		ring_buffer_consume(tx_ring, from_ring);
+	if (from_data < length)
+		ring_buffer_append(tx_ring, data + from_data, length - from_data);
 	
 	stream->send_window -= max;
 
 	return max;
 }
 
-static void 
-deprecated_handle_tcp_mux_frps_msg(uint8_t *buf, int ilen, void (*fn)(uint8_t *, int, void *))
-{
-	static uint32_t l_stream_id = 0;
-	static uint32_t l_dlen = 0;
-	static uint32_t l_type = 0;
-	static uint32_t l_flag = 0;
-	static int8_t only_data = 0;
-	uint8_t *data = buf;
-	while (ilen > 0) {
-		uint32_t type = 0, stream_id = 0, dlen = 0, flag = 0;
-		uint32_t is_tmux;
-		if (only_data) {
-			is_tmux = 0;
-			only_data = 0;
-		} else {
-			is_tmux = parse_tcp_mux_proto(data, ilen, &flag, &type, &stream_id, &dlen);
-		}	
-		if (!is_tmux) {
-			struct proxy_client *pc = get_proxy_client(l_stream_id);
-			debug(LOG_DEBUG, "receive only %s data : l_stream_id %d l_type %s l_flag %s l_dlen %d ilen %d", 
-							!pc?"main control ":"worker ", 
-							l_stream_id, type_2_desc(l_type), 
-							flag_2_desc(l_flag), l_dlen, ilen);
-			assert(ilen);
-			if (ilen == 12)
-				dump_tcp_mux_header(data, ilen);
-
-			if (!pc || (pc && !pc->local_proxy_bev)) {
-				assert(ilen >= l_dlen);
-				assert(l_dlen > 0);
-				fn(data, l_dlen, pc);
-				data += l_dlen;
-				ilen -= l_dlen;
-				l_dlen = 0;
-				continue;
-			}
-			
-			if (pc->stream.state != ESTABLISHED) {
-				debug(LOG_INFO, "client [%d] state is [%d]", pc->stream_id, pc->stream.state);
-				break;
-			}
+// frame at most max bytes, parked tx_ring bytes first and then src, onto
+// bev; src chains are moved without copying them, through the stream's
+// cipher if it has one. return the bytes framed
+static uint32_t
+tmux_write_evbuffer(struct bufferevent *bev, struct evbuffer *src, 
+				struct tmux_stream *stream, uint32_t max)
+{
+	struct ring_buffer *tx_ring = &stream->tx_ring;
+	uint16_t flags = get_send_flags(stream);
 
-			if ( ilen >= l_dlen) {
-				assert(pc->local_proxy_bev);
-				bufferevent_write(pc->local_proxy_bev, data, l_dlen);
-				data += l_dlen;
-				ilen -= l_dlen;
-				l_dlen = 0;
-			} else {
-				assert(pc->local_proxy_bev);
-				bufferevent_write(pc->local_proxy_bev, data, ilen);
-				l_dlen -= ilen;
-				ilen 	= 0;
-			}
+	// data parked by tmux_write() shares the header reservation and
+	// goes out first to keep stream order
+	struct evbuffer_iovec payload[2];
+	int n = ring_buffer_peek(tx_ring, max, payload);
+	uint32_t from_ring = 0;
+	for (int i = 0; i < n; i++)
+		from_ring += payload[i].iov_len;
+
+	// an aead cipher adds record overhead, only whole records that fit go
+	uint32_t left = max - from_ring;
+	struct crypto_stream *enc = NULL;
+	if (left > 0) {
+		assert(src);
+		struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+		enc = slot && slot->pc ? slot->pc->enc : NULL;
+		if (enc) {
+			size_t plain = crypto_stream_plain_room(enc, left);
+			if (plain > evbuffer_get_length(src))
+				plain = evbuffer_get_length(src);
+			left = plain;
+		}
+	}
+	uint32_t wire = enc ? crypto_stream_wire_size(enc, left) : left;
+	if (from_ring + wire == 0)
+		return 0;
 
+	struct tcp_mux_header tmux_hdr;
+	tcp_mux_encode(DATA, flags, stream->id, from_ring + wire, &tmux_hdr);
+	tcp_mux_write_frame(bev, &tmux_hdr, payload, n);
+	if (from_ring > 0)
+		ring_buffer_consume(tx_ring, from_ring);
+	if (enc && left > 0)
+		crypto_stream_seal(enc, src, left, bufferevent_get_output(bev));
+	else if (left > 0)
+		evbuffer_remove_buffer(src, bufferevent_get_output(bev), left);
+
+	stream->send_window -= from_ring + wire;
+	return from_ring + wire;
+}
+
+static struct bufferevent *
+stream_local_bev(struct tmux_stream *stream)
+{
+	struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+	if (!slot || !slot->pc)
+		return NULL;
+
+	return slot->pc->local_proxy_bev;
+}
+
+static void
+sched_link(struct tmux_stream *stream)
+{
+	if (stream->sched_active)
+		return;
+
+	struct tmux_session *session = stream->session;
+	struct tmux_slot *slot = get_stream_slot(session, stream->id);
+	uint32_t weight = 1;
+	if (slot && slot->pc && slot->pc->ps)
+		weight = slot->pc->ps->weight;
+	stream->quantum = weight * TMUX_SCHED_FRAME;
+	stream->sched_active = 1;
+
+	struct tmux_stream *cur = session->sched_cur;
+	if (!cur) {
+		stream->sched_next = stream->sched_prev = stream;
+		stream->deficit = stream->quantum;
+		session->sched_cur = stream;
+		return;
+	}
+
+	// join at the tail of the current round
+	stream->deficit = 0;
+	stream->sched_next = cur;
+	stream->sched_prev = cur->sched_prev;
+	cur->sched_prev->sched_next = stream;
+	cur->sched_prev = stream;
+}
+
+static void
+sched_advance(struct tmux_session *session)
+{
+	session->sched_cur = session->sched_cur->sched_next;
+	session->sched_cur->deficit += session->sched_cur->quantum;
+}
+
+static void
+sched_unlink(struct tmux_stream *stream)
+{
+	if (!stream->sched_active)
+		return;
+
+	struct tmux_session *session = stream->session;
+	if (stream->sched_next == stream) {
+		session->sched_cur = NULL;
+	} else {
+		stream->sched_prev->sched_next = stream->sched_next;
+		stream->sched_next->sched_prev = stream->sched_prev;
+		if (session->sched_cur == stream) {
+			session->sched_cur = stream->sched_prev;
+			sched_advance(session);
+		}
+	}
+
+	stream->sched_next = stream->sched_prev = NULL;
+	stream->deficit = 0;
+	stream->sched_active = 0;
+}
+
+// data from frps still on its way to the local service
+static int
+stream_local_pending(struct tmux_stream *stream)
+{
+	struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+	if (!slot || !slot->pc || !slot->pc->local_proxy_bev)
+		return 0;
+
+	struct proxy_client *pc = slot->pc;
+	if (pc->local_shut)
+		return 0;
+	return evbuffer_get_length(bufferevent_get_output(pc->local_proxy_bev)) > 0 ||
+			(pc->dec && pc->dec->inflight);
+}
+
+// a work connection offered to frps that no StartWorkConn claimed yet
+static int
+stream_idle(struct tmux_stream *stream)
+{
+	struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+	return slot && slot->pc && !slot->pc->work_started;
+}
+
+// run the local write callback from the loop: it passes frps's FIN on,
+// or frees a closed stream, once the local output drained
+static void
+stream_poke_local(struct tmux_stream *stream)
+{
+	struct bufferevent *local = stream_local_bev(stream);
+	if (local)
+		bufferevent_trigger(local, EV_WRITE, 
+						BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+}
+
+static void
+send_stream_fin(struct tmux_stream *stream)
+{
+	stream->fin_pending = 0;
+	tcp_mux_send_win_update_fin(stream->session->bev, stream->id);
+	if (stream->state == REMOTE_CLOSE) {
+		// both sides are done
+		stream->state = CLOSED;
+		stream_poke_local(stream);
+	} else {
+		stream->state = LOCAL_CLOSE;
+	}
+}
+
+// serve streams with queued local input in deficit round robin order:
+// each visit a stream may send up to weight * TMUX_SCHED_FRAME bytes,
+// cut into frames of at most TMUX_SCHED_FRAME, so a bulk transfer can
+// not hold the connection for longer than one frame per round
+void
+tmux_sched_run(struct tmux_session *session)
+{
+	if (!session->bev)
+		return;
+
+	struct bufferevent *bout = session->bev;
+	struct evbuffer *out = bufferevent_get_output(bout);
+	while (session->sched_cur && evbuffer_get_length(out) < TMUX_SCHED_HIWAT) {
+		struct tmux_stream *stream = session->sched_cur;
+		struct bufferevent *local = stream_local_bev(stream);
+		struct evbuffer *src = local ? bufferevent_get_input(local) : NULL;
+		uint32_t avail = stream->tx_ring.sz + (src ? evbuffer_get_length(src) : 0);
+
+		if (avail == 0 || stream->send_window == 0) {
+			// drained, or blocked until the peer opens the window
+			if (avail == 0 && stream->fin_pending)
+				send_stream_fin(stream);
+			sched_unlink(stream);
 			continue;
 		}
-		
-		struct proxy_client *pc = get_proxy_client(stream_id);
-		debug(LOG_DEBUG, "[%s] receive tcp mux type [%s] flag [%s] stream_id [%d] dlen [%d] ilen [%d]", 
-						pc?"worker":"main control",
-						type_2_desc(type), flag_2_desc(flag), stream_id, dlen, ilen);
-		data += sizeof(struct tcp_mux_header);
-		ilen -= sizeof(struct tcp_mux_header);
-		l_stream_id = stream_id;
-		l_type = type;
-		l_flag = flag;
-		l_dlen = type==PING?0:dlen;
-		assert(ilen >= 0);
-
-		switch(type) {
-		case DATA:
-		{
-			if (ilen == 0) {
-				only_data = 1;
-				break;
+
+		uint32_t max = avail;
+		if (max > TMUX_SCHED_FRAME) max = TMUX_SCHED_FRAME;
+		if (max > stream->send_window) max = stream->send_window;
+		if (max > stream->deficit) max = stream->deficit;
+		uint32_t sent = tmux_write_evbuffer(bout, src, stream, max);
+		if (sent == 0) {
+			// window too small for a whole cipher record, wait for more
+			sched_unlink(stream);
+			continue;
+		}
+		stream->deficit -= sent;
+
+		if (local && !stream->fin_pending && 
+			evbuffer_get_length(src) < TMUX_SCHED_FRAME)
+			bufferevent_enable(local, EV_READ);
+		if (stream->deficit == 0)
+			sched_advance(session);
+	}
+}
+
+// stream has new local input; it leaves through tmux_sched_run()
+void
+tmux_stream_schedule(struct tmux_stream *stream)
+{
+	switch(stream->state) {
+	case LOCAL_CLOSE:
+	case CLOSED:
+	case RESET:
+		debug(LOG_INFO, "stream %d state is closed", stream->id);
+		return;
+	default:
+		break;
+	}
+
+	sched_link(stream);
+	tmux_sched_run(stream->session);
+}
+
+// window opened on a stream the scheduler dropped while it still had
+// data or a FIN queued: put it back in the round and flush the tail now
+// instead of waiting for the local service to produce more
+static void
+tmux_stream_unblock(struct tmux_stream *stream)
+{
+	struct bufferevent *local = stream_local_bev(stream);
+	if (stream->tx_ring.sz == 0 && !stream->fin_pending &&
+		(!local || evbuffer_get_length(bufferevent_get_input(local)) == 0))
+		return;
+
+	sched_link(stream);
+	tmux_sched_run(stream->session);
+}
+
+// the local service's output drained, or a crypto worker handed its
+// bytes over: reopen the receive window by what it took
+void
+tmux_stream_drained(struct tmux_stream *stream)
+{
+	if (!stream->session || !stream->session->bev)
+		return;
+
+	struct tmux_slot *slot = get_stream_slot(stream->session, stream->id);
+	uint32_t buffered = local_buffered(slot ? slot->pc : NULL);
+
+	switch(stream->state) {
+	case SYN_SEND:
+	case ESTABLISHED:
+	case LOCAL_CLOSE:
+		send_window_update(stream->session->bev, stream, buffered);
+		break;
+	default:
+		break;
+	}
+}
+
+// local side is done; FIN is sent once the queued data has been framed
+void
+tmux_stream_close(struct tmux_stream *stream)
+{
+	// an error may follow the EOF that already closed it
+	if (stream->fin_pending || stream->state == LOCAL_CLOSE || 
+		stream->state == CLOSED || stream->state == RESET)
+		return;
+
+	stream->fin_pending = 1;
+	if (stream->sched_active) {
+		tmux_sched_run(stream->session);
+		return;
+	}
+
+	struct bufferevent *local = stream_local_bev(stream);
+	if (local && evbuffer_get_length(bufferevent_get_input(local)) > 0) {
+		tmux_stream_schedule(stream);
+		return;
+	}
+
+	send_stream_fin(stream);
+}
+
+// copy the header at the front of input through evbuffer_peek(), so a
+// header split over several chains needs no pullup
+static void
+peek_tcp_mux_header(struct evbuffer *input, struct tcp_mux_header *tmux_hdr)
+{
+	struct evbuffer_iovec vec[sizeof(struct tcp_mux_header)];
+	int n = evbuffer_peek(input, sizeof(struct tcp_mux_header), NULL, vec, 
+					sizeof(struct tcp_mux_header));
+	uint8_t *p = (uint8_t *)tmux_hdr;
+	size_t left = sizeof(struct tcp_mux_header);
+	for (int i = 0; i < n && left > 0; i++) {
+		size_t len = vec[i].iov_len < left ? vec[i].iov_len : left;
+		memcpy(p, vec[i].iov_base, len);
+		p += len;
+		left -= len;
+	}
+	assert(left == 0);
+}
+
+static void
+dispatch_tcp_mux_frame(struct tmux_session *session, struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
+{
+	switch(tmux_hdr->type) {
+	case DATA:
+	case WINDOW_UPDATE:
+		handle_tcp_mux_stream(session, tmux_hdr, fn);
+		break;
+	case PING:
+		handle_tcp_mux_ping(session, tmux_hdr);
+		break;
+	case GO_AWAY:
+		handle_tcp_mux_go_away(session, tmux_hdr);
+		break;
+	default:
+		debug(LOG_ERR, "impossible here!!!!");
+		break;
+	}
+}
+
+// consume every complete frame, and any partial DATA payload, that is
+// in the session's input; parsing resumes from its parser on the next call
+void
+handle_tcp_mux_input(struct tmux_session *session, handle_data_fn_t fn)
+{
+	struct bufferevent *bev = session->bev;
+	struct tmux_parser *parser = &session->parser;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	for (;;) {
+		size_t len = evbuffer_get_length(input);
+		if (parser->state == PARSE_HEADER) {
+			if (len < sizeof(struct tcp_mux_header))
+				return;
+
+			struct tcp_mux_header *tmux_hdr = &parser->hdr;
+			peek_tcp_mux_header(input, tmux_hdr);
+			evbuffer_drain(input, sizeof(struct tcp_mux_header));
+			// a slow ping ack is no missed ping while frames still arrive
+			session->ping_missed = 0;
+			if (!validate_tcp_mux_protocol(tmux_hdr)) {
+				debug(LOG_ERR, "invalid tcp mux header: version %d type %d", 
+								tmux_hdr->version, tmux_hdr->type);
+				tcp_mux_send_go_away(bev, PROTO_ERR);
+				evbuffer_drain(input, evbuffer_get_length(input));
+				return;
 			}
 
-			if (!pc || (pc && !pc->local_proxy_bev)) {
-				assert(ilen >= dlen);
-				fn(data, dlen, pc);
-				data += dlen;
-				ilen -= dlen;
-				l_dlen = 0;
+			if (tmux_hdr->type != DATA) {
+				dispatch_tcp_mux_frame(session, tmux_hdr, fn);
 				continue;
 			}
-			
-			if (pc->stream.state != ESTABLISHED) {
-				debug(LOG_INFO, "client [%d] state is [%d]", pc->stream_id, pc->stream.state);
-				break;
-			}
-			
-			if (ilen >= dlen){
-				assert(pc->local_proxy_bev);
-				bufferevent_write(pc->local_proxy_bev, data, dlen);
-				data += dlen;
-				ilen -= dlen;
-				l_dlen = 0;
-			} else {
-				assert(pc->local_proxy_bev);
-				bufferevent_write(pc->local_proxy_bev, data, ilen);
-				l_dlen -= ilen;
-				ilen 	= 0;
-			}
-			break;
-		} 
-		case PING:
-		{
-			struct bufferevent *bout = get_main_control()->connect_bev;
-			uint32_t seq = dlen;
-			assert(bout);
-			if (flag == SYN)
-				tcp_mux_handle_ping(bout, seq);
-			break;
-		} 
-		case WINDOW_UPDATE:
-		{
-			switch(flag) {
-			case RST:
-			case FIN:
-				del_proxy_client(pc);
-				break;
-			case ZERO:
-			case ACK:	
-				if (!pc)
-					break;
-
-				if (dlen > 0) {
-					pc->stream.send_window += dlen;
-					bufferevent_enable(pc->local_proxy_bev, EV_READ|EV_WRITE);
-				}
-				pc->stream.state = ESTABLISHED;
-				break;
-			default:
-				debug(LOG_INFO, "window update no need process : flag %2x %s dlen %d stream_id %d", 
-								flag, flag_2_desc(flag), dlen, stream_id);
-			}
-			
-			break;
-		} 
-		default:
-			debug(LOG_INFO, "no need unhandle tcp mux msg : type %s flag %s stream_id %d dlen %d ilen %d", 
-							type_2_desc(type), flag_2_desc(flag),  stream_id, dlen, ilen);
+
+			uint32_t stream_id = ntohl(tmux_hdr->stream_id);
+			parser->stream = get_stream_by_id(session, stream_id);
+			parser->remain = ntohl(tmux_hdr->length);
+			if (!parser->stream)
+				debug(LOG_INFO, "drop %s for unknown stream_id %d flag %s", 
+								type_2_desc(tmux_hdr->type), stream_id, 
+								flag_2_desc(ntohs(tmux_hdr->flags)));
+			parser->state = PARSE_DATA;
 		}
+
+		if (parser->remain > 0) {
+			// the header above may have taken what len counted
+			len = evbuffer_get_length(input);
+			if (len == 0)
+				return;
+
+			uint32_t n = len < parser->remain ? len : parser->remain;
+			uint32_t nr = n;
+			if (parser->stream)
+				nr = tmux_read(bev, parser->stream, n);
+			else
+				evbuffer_drain(input, n);
+			parser->remain -= nr;
+			if (parser->remain > 0)
+				return;
+		}
+
+		parser->state = PARSE_HEADER;
+		if (parser->stream)
+			dispatch_tcp_mux_frame(session, &parser->hdr, fn);
+		parser->stream = NULL;
 	}
 }
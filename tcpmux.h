@@ -31,12 +31,29 @@
 
 #define	MAX_STREAM_WINDOW_SIZE	256*1024
 #define	RBUF_SIZE	32*1024
-
+#define	RBUF_MIN_SIZE	4*1024
+#define	TMUX_MAX_SINGLE_IO	128*1024
+#define	STREAM_SLOT_MIN	64
+#define	TMUX_MAX_SESSIONS	16
+#define	TMUX_SESSION_RETRY	2	// seconds before a lost extra session reconnects
+#define	TMUX_MIN_RTO	1000	// ms
+#define	TMUX_MAX_RTO	60000
+#define	TMUX_PING_MAX_MISSED	3	// silent RTOs in a row, each doubling the last
+#define	TMUX_SCHED_FRAME	16*1024		// largest DATA frame of a scheduled stream
+#define	TMUX_SCHED_HIWAT	TMUX_MAX_SINGLE_IO	// stop scheduling above this much queued output
+#define	TMUX_SCHED_LOWAT	TMUX_SCHED_HIWAT/2	// resume once output drains below
+
+struct proxy_client;
+struct tmux_session;
+
+// data is taken from a size-classed pool on first write and given back
+// as soon as the ring drains, so idle streams carry no buffer memory
 struct ring_buffer {
 	uint32_t cur;
 	uint32_t end;
 	uint32_t sz;
-	uint8_t data[RBUF_SIZE];
+	uint32_t cap;
+	uint8_t *data;
 };
 
 enum go_away_type {
@@ -94,17 +111,87 @@ struct tmux_stream {
 	uint32_t	recv_window;
 	uint32_t	send_window;	
 	enum tcp_mux_state state;	
+
+	// receive window auto-tuning
+	uint32_t	max_recv_window;	// grows up to tcp_mux_max_window
+	uint32_t	rtt;				// ms, sampled from SYN to ACK
+	uint64_t	syn_time;
+	uint64_t	win_update_time;	// when last window update was sent
+
 	struct ring_buffer	tx_ring;
 	struct ring_buffer 	rx_ring;
 
-	// private arguments
-	UT_hash_handle hh;
+	// deficit round robin transmit scheduling
+	struct tmux_stream	*sched_next;
+	struct tmux_stream	*sched_prev;
+	uint32_t	quantum;	// proxy weight * TMUX_SCHED_FRAME
+	uint32_t	deficit;
+	uint8_t		sched_active;
+	uint8_t		fin_pending;	// local side closed, FIN follows the queued data
+
+	struct tmux_session	*session;	// set by add_stream()
+};
+
+// stream table entry, slot index is (id >> 1) & (cap - 1)
+struct tmux_slot {
+	uint32_t	id;		// full id, rejects stale ids mapping to a reused slot
+	struct tmux_stream	*stream;
+	struct proxy_client	*pc;	// NULL for the control stream
+};
+
+enum tmux_parse_state {
+	PARSE_HEADER = 0,
+	PARSE_DATA,
+};
+
+// receive side state, kept across reads so frames may be split anywhere
+struct tmux_parser {
+	enum tmux_parse_state	state;
+	struct tcp_mux_header	hdr;
+	uint32_t	remain;		// DATA payload bytes not yet consumed
+	struct tmux_stream	*stream;	// NULL: discard payload of unknown stream
+};
+
+// one mux connection to frps, with its own stream id space, stream
+// table, transmit scheduler and flow control
+struct tmux_session {
+	struct bufferevent	*bev;
+	uint8_t		ready;		// connected, may carry new streams
+	struct tmux_parser	parser;
+	uint32_t	next_id;
+	struct tmux_slot	*slots;		// indexed by stream id >> 1
+	uint32_t	slot_cap;
+	uint32_t	slot_used;
+	struct tmux_stream	*sched_cur;	// stream the scheduler serves next
+	uint8_t		remote_go_away;
+	uint8_t		local_go_away;
+
+	// keepalive, RTT estimated as in RFC 6298
+	struct event	*ping_event;
+	void		(*dead_cb)(struct tmux_session *);
+	uint32_t	ping_id;	// outstanding ping, 0 if none
+	uint32_t	last_ping_id;
+	uint64_t	ping_time;
+	uint32_t	srtt;		// ms, 0 until the first sample
+	uint32_t	rttvar;
+	uint32_t	rto;
+	uint8_t		ping_missed;
 };
 
 typedef void (*handle_data_fn_t)(uint8_t *, int, void *);
 
+void init_tmux_session(struct tmux_session *session);
+
+void reset_tmux_session(struct tmux_session *session);
+
+void start_tmux_keepalive(struct tmux_session *session, void (*dead_cb)(struct tmux_session *));
+
+void stop_tmux_keepalive(struct tmux_session *session);
+
 void init_tmux_stream(struct tmux_stream *stream, uint32_t id, enum tcp_mux_state state);
 
+void release_tmux_stream_buffer(struct tmux_stream *stream);
+
 int validate_tcp_mux_protocol(struct tcp_mux_header *tmux_hdr);
 
 void send_window_update(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length);
@@ -121,31 +208,39 @@ void tcp_mux_send_data(struct bufferevent *bout, uint16_t flags, uint32_t stream
 
 void tcp_mux_send_ping(struct bufferevent *bout, uint32_t ping_id);
 
-uint32_t get_next_session_id();
+uint32_t get_next_session_id(struct tmux_session *session);
 
 void tcp_mux_encode(enum tcp_mux_type type, enum tcp_mux_flag flags, 
 				uint32_t stream_id, uint32_t length, struct tcp_mux_header *tmux_hdr);
 
-int handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn);
+int handle_tcp_mux_stream(struct tmux_session *session, struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn);
 
-void handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr);
+void handle_tcp_mux_ping(struct tmux_session *session, struct tcp_mux_header *tmux_hdr);
 
-void handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr);
+void handle_tcp_mux_go_away(struct tmux_session *session, struct tcp_mux_header *tmux_hdr);
 
 uint32_t tmux_write(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_stream *stream);
 
+void tmux_stream_schedule(struct tmux_stream *stream);
+
+void tmux_stream_close(struct tmux_stream *stream);
+
+void tmux_stream_drained(struct tmux_stream *stream);
+
+void tmux_sched_run(struct tmux_session *session);
+
 uint32_t tmux_read(struct bufferevent *bev, struct tmux_stream *stream, uint32_t len);
 
-void reset_session_id();
+void handle_tcp_mux_input(struct tmux_session *session, handle_data_fn_t fn);
 
-struct tmux_stream *get_cur_stream();
+void add_stream(struct tmux_session *session, struct tmux_stream *stream, struct proxy_client *pc);
 
-void set_cur_stream(struct tmux_stream *stream);
+void del_stream(struct tmux_session *session, uint32_t stream_id);
 
-void add_stream(struct tmux_stream *stream);
+struct tmux_slot *get_stream_slot(struct tmux_session *session, uint32_t id);
 
-void del_stream(uint32_t stream_id);
+struct tmux_stream* get_stream_by_id(struct tmux_session *session, uint32_t id);
 
-struct tmux_stream* get_stream_by_id(uint32_t id);
+void foreach_stream_client(struct tmux_session *session, void (*fn)(struct proxy_client *));
 
 #endif
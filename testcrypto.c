@@ -0,0 +1,158 @@
+/*
+ * Standalone test of the work connection ciphers: for each of them, a
+ * stream sealed in uneven chunks must open to the same bytes whatever
+ * reads it arrives in. A flipped ciphertext, tag or length byte, or a
+ * different token, must fail an aead stream with -1 and release nothing
+ * of the record it hit; aes-128-cfb has no tag and only garbles it.
+ *
+ * gcc --std=gnu99 -o testcrypto testcrypto.c crypto.c debug.c \
+ *     fastpbkdf2.c -levent -lcrypto -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <event2/buffer.h>
+
+#include "crypto.h"
+#include "config.h"
+#include "debug.h"
+
+#define	TOKEN		"test-token"
+#define	PLAIN_LEN	(100*1000)	// several aead records, the last one short
+
+static struct common_conf conf;
+
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+static const char *cipher_names[] = {"aes-128-cfb", "aes-128-gcm", "chacha20-poly1305"};
+static const size_t seal_sizes[] = {1, 7, 1000, CIPHER_AEAD_RECORD, 20000, 3};
+static uint8_t plain[PLAIN_LEN];
+
+// the iv, then plain sealed in chunks of uneven sizes
+static struct evbuffer *
+seal_all(const char *token)
+{
+	struct crypto_stream *enc = new_crypto_stream(token, 1);
+	struct evbuffer *src = evbuffer_new(), *wire = evbuffer_new();
+	evbuffer_add(wire, enc->iv, enc->iv_len);
+	evbuffer_add(src, plain, PLAIN_LEN);
+	for (size_t i = 0, done = 0; done < PLAIN_LEN; i++) {
+		size_t n = seal_sizes[i % (sizeof(seal_sizes) / sizeof(seal_sizes[0]))];
+		if (n > PLAIN_LEN - done)
+			n = PLAIN_LEN - done;
+		crypto_stream_seal(enc, src, n, wire);
+		done += n;
+	}
+	assert(evbuffer_get_length(src) == 0);
+
+	evbuffer_free(src);
+	free_crypto_stream(enc);
+	return wire;
+}
+
+// feed wire in reads of step bytes into out; -1 once it failed
+static int
+open_all(struct evbuffer *wire, size_t step, struct evbuffer *out)
+{
+	struct crypto_stream *dec = new_crypto_stream(TOKEN, 0);
+	int ret = 0;
+	while (evbuffer_get_length(wire) && ret == 0) {
+		size_t n = evbuffer_get_length(wire) < step ? evbuffer_get_length(wire) : step;
+		ret = crypto_stream_open(dec, wire, n, out);
+	}
+	assert(ret < 0 || evbuffer_get_length(wire) == 0);
+
+	free_crypto_stream(dec);
+	return ret;
+}
+
+static void
+flip(struct evbuffer *wire, size_t off)
+{
+	uint8_t *p = evbuffer_pullup(wire, -1);
+	p[off] ^= 0x40;
+}
+
+static void
+test_round_trip()
+{
+	static const size_t steps[] = {1, 5, 4096, 65536, PLAIN_LEN * 2};
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		struct evbuffer *wire = seal_all(TOKEN);
+		struct evbuffer *out = evbuffer_new();
+		assert(open_all(wire, steps[i], out) == 0);
+		assert(evbuffer_get_length(out) == PLAIN_LEN);
+		assert(memcmp(evbuffer_pullup(out, -1), plain, PLAIN_LEN) == 0);
+		evbuffer_free(wire);
+		evbuffer_free(out);
+	}
+}
+
+// the first record is the one byte chunk; tamper with the one after it
+static void
+test_tamper(int aead)
+{
+	const size_t iv = 16;
+	const size_t first = aead ? CIPHER_AEAD_HDR + 1 + CIPHER_AEAD_TAG : 1;
+	const size_t at[] = {
+		first + 3,							// ciphertext
+		first + CIPHER_AEAD_HDR + 7,		// tag of the 7 byte record
+		first,								// length
+	};
+
+	for (int i = 0; i < (aead ? 3 : 1); i++) {
+		struct evbuffer *wire = seal_all(TOKEN);
+		struct evbuffer *out = evbuffer_new();
+		flip(wire, iv + at[i]);
+		int r = open_all(wire, 4096, out);
+		if (aead) {
+			assert(r == -1);
+			assert(evbuffer_get_length(out) == 1);
+		} else {
+			assert(r == 0);
+			assert(evbuffer_get_length(out) == PLAIN_LEN);
+			assert(memcmp(evbuffer_pullup(out, -1), plain, PLAIN_LEN) != 0);
+		}
+		evbuffer_free(wire);
+		evbuffer_free(out);
+	}
+
+	if (!aead)
+		return;
+
+	// keyed from another token
+	struct evbuffer *wire = seal_all("other-token");
+	struct evbuffer *out = evbuffer_new();
+	assert(open_all(wire, 4096, out) == -1);
+	assert(evbuffer_get_length(out) == 0);
+	evbuffer_free(wire);
+	evbuffer_free(out);
+}
+
+int main(void)
+{
+	debugconf.debuglevel = LOG_CRIT;
+	conf.auth_token = TOKEN;
+	for (int i = 0; i < PLAIN_LEN; i++)
+		plain[i] = i % 251;
+
+	for (size_t i = 0; i < sizeof(cipher_names) / sizeof(cipher_names[0]); i++) {
+		if (set_work_cipher(cipher_names[i]) < 0) {
+			printf("- %s not built in, skipped\n", cipher_names[i]);
+			continue;
+		}
+		test_round_trip();
+		test_tamper(i > 0);
+		printf("- %s test passed\n", cipher_names[i]);
+	}
+
+	free_key_cache();
+	return 0;
+}
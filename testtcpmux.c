@@ -0,0 +1,387 @@
+/*
+ * Standalone test of the tcp mux receive parser: a run of frames split
+ * at every byte boundary, and fed one byte at a time, must dispatch just
+ * as it does when it arrives in one read. Then the tail of a response
+ * that outgrew the send window must leave with the WINDOW_UPDATE that
+ * reopens it, not wait for more local input. Last, encrypted data still
+ * with a crypto worker must hold the receive window back like data the
+ * local service has not read.
+ *
+ * gcc --std=gnu99 -o testtcpmux testtcpmux.c tcpmux.c debug.c utils.c \
+ *     crypto.c fastpbkdf2.c -levent -lcrypto -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "tcpmux.h"
+#include "client.h"
+#include "crypto.h"
+#include "config.h"
+#include "debug.h"
+
+#define	CTL_ID		1
+#define	WORK_ID		3
+#define	GONE_ID		97		// no such stream, its payload is dropped
+#define	PING_ID		0x1234
+#define	WIN_DELTA	4096
+
+#define	MSG1		"NewProxyResp"
+#define	MSG2		"Pong"
+#define	WORK_DATA	"hello local service"
+#define	GONE_DATA	"stale"
+
+#define	RESP_LEN	3000	// local service response
+#define	RESP_WINDOW	1000	// send window left when it arrives
+
+#define	CRYPT_LEN	(200*1024)	// over half the window, so it would reopen at once
+#define	TOKEN		"test-token"
+
+static struct common_conf conf;
+static struct event_base *base;
+
+// tcpmux.c only needs these two from the rest of xfrpc
+struct common_conf *
+get_common_config()
+{
+	return &conf;
+}
+
+void
+del_proxy_client_by_stream(struct tmux_stream *stream)
+{
+	del_stream(stream->session, stream->id);
+}
+
+static char msgs[4][32];
+static int nmsg;
+
+static void
+on_msg(uint8_t *data, int len, void *pc)
+{
+	assert(pc == NULL);
+	assert(nmsg < 4 && len < 32);
+	memcpy(msgs[nmsg], data, len);
+	msgs[nmsg][len] = '\0';
+	nmsg++;
+}
+
+struct fixture {
+	struct tmux_session	session;
+	struct tmux_stream	ctl;
+	struct proxy_client	*pc;
+};
+
+// socket bufferevents without an fd, unfrozen so the test can play frps
+static struct bufferevent *
+new_bev()
+{
+	struct bufferevent *bev = bufferevent_socket_new(base, -1, 0);
+	assert(bev);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+	evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+	return bev;
+}
+
+static void
+setup(struct fixture *f)
+{
+	memset(f, 0, sizeof(*f));
+	init_tmux_session(&f->session);
+	f->session.bev = new_bev();
+
+	init_tmux_stream(&f->ctl, CTL_ID, ESTABLISHED);
+	add_stream(&f->session, &f->ctl, NULL);
+
+	f->pc = calloc(1, sizeof(struct proxy_client));
+	assert(f->pc);
+	f->pc->stream_id = WORK_ID;
+	f->pc->work_started = 1;
+	f->pc->local_proxy_bev = new_bev();
+	init_tmux_stream(&f->pc->stream, WORK_ID, ESTABLISHED);
+	add_stream(&f->session, &f->pc->stream, f->pc);
+
+	nmsg = 0;
+	memset(msgs, 0, sizeof(msgs));
+}
+
+static void
+teardown(struct fixture *f)
+{
+	del_stream(&f->session, WORK_ID);
+	del_stream(&f->session, CTL_ID);
+	release_tmux_stream_buffer(&f->pc->stream);
+	release_tmux_stream_buffer(&f->ctl);
+	bufferevent_free(f->pc->local_proxy_bev);
+	free(f->pc);
+	bufferevent_free(f->session.bev);
+	free(f->session.slots);
+}
+
+static void
+add_frame(struct evbuffer *buf, enum tcp_mux_type type, enum tcp_mux_flag flags,
+		uint32_t id, uint32_t length, const char *payload)
+{
+	struct tcp_mux_header hdr;
+	tcp_mux_encode(type, flags, id, length, &hdr);
+	evbuffer_add(buf, &hdr, sizeof(hdr));
+	if (payload)
+		evbuffer_add(buf, payload, length);
+}
+
+// what frps might send in one go: messages on the control stream, a
+// ping, a window update and data for the worker, and a late frame for
+// a stream that is already gone
+static size_t
+build_wire(uint8_t **wire)
+{
+	struct evbuffer *buf = evbuffer_new();
+	add_frame(buf, DATA, ZERO, CTL_ID, strlen(MSG1), MSG1);
+	add_frame(buf, PING, SYN, 0, PING_ID, NULL);
+	add_frame(buf, WINDOW_UPDATE, ZERO, WORK_ID, WIN_DELTA, NULL);
+	add_frame(buf, DATA, ZERO, GONE_ID, strlen(GONE_DATA), GONE_DATA);
+	add_frame(buf, DATA, ZERO, WORK_ID, strlen(WORK_DATA), WORK_DATA);
+	add_frame(buf, DATA, ZERO, CTL_ID, strlen(MSG2), MSG2);
+
+	size_t len = evbuffer_get_length(buf);
+	*wire = malloc(len);
+	assert(*wire);
+	evbuffer_remove(buf, *wire, len);
+	evbuffer_free(buf);
+	return len;
+}
+
+static void
+feed(struct fixture *f, const uint8_t *data, size_t len)
+{
+	evbuffer_add(bufferevent_get_input(f->session.bev), data, len);
+	handle_tcp_mux_input(&f->session, on_msg);
+}
+
+// the session output must hold the ping ack and nothing but window
+// updates besides
+static void
+check_output(struct fixture *f)
+{
+	struct evbuffer *out = bufferevent_get_output(f->session.bev);
+	int acks = 0;
+	while (evbuffer_get_length(out) >= sizeof(struct tcp_mux_header)) {
+		struct tcp_mux_header hdr;
+		evbuffer_remove(out, &hdr, sizeof(hdr));
+		if (hdr.type == PING) {
+			assert(ntohs(hdr.flags) == ACK);
+			assert(ntohl(hdr.length) == PING_ID);
+			acks++;
+		} else {
+			assert(hdr.type == WINDOW_UPDATE);
+		}
+	}
+	assert(evbuffer_get_length(out) == 0);
+	assert(acks == 1);
+}
+
+static void
+check(struct fixture *f)
+{
+	struct evbuffer *local = bufferevent_get_output(f->pc->local_proxy_bev);
+	char got[64];
+	size_t n = evbuffer_get_length(local);
+
+	assert(f->session.parser.state == PARSE_HEADER);
+	assert(evbuffer_get_length(bufferevent_get_input(f->session.bev)) == 0);
+
+	assert(nmsg == 2);
+	assert(strcmp(msgs[0], MSG1) == 0);
+	assert(strcmp(msgs[1], MSG2) == 0);
+
+	assert(n == strlen(WORK_DATA));
+	evbuffer_remove(local, got, n);
+	assert(memcmp(got, WORK_DATA, n) == 0);
+
+	assert(f->pc->stream.send_window == MAX_STREAM_WINDOW_SIZE + WIN_DELTA);
+	assert(f->ctl.recv_window == MAX_STREAM_WINDOW_SIZE - strlen(MSG1) - strlen(MSG2));
+	check_output(f);
+}
+
+// sum the DATA payload framed for id, checking it continues the
+// response at *off
+static size_t
+take_data(struct fixture *f, uint32_t id, size_t *off)
+{
+	struct evbuffer *out = bufferevent_get_output(f->session.bev);
+	size_t total = 0;
+	while (evbuffer_get_length(out) >= sizeof(struct tcp_mux_header)) {
+		struct tcp_mux_header hdr;
+		evbuffer_remove(out, &hdr, sizeof(hdr));
+		if (hdr.type != DATA)
+			continue;
+		assert(ntohl(hdr.stream_id) == id);
+		for (uint32_t n = ntohl(hdr.length); n > 0; n--) {
+			uint8_t c;
+			evbuffer_remove(out, &c, 1);
+			assert(c == (uint8_t)(*off % 251));
+			(*off)++;
+			total++;
+		}
+	}
+	return total;
+}
+
+static void
+test_window_tail(struct fixture *f)
+{
+	struct evbuffer *local_in = bufferevent_get_input(f->pc->local_proxy_bev);
+	struct tcp_mux_header hdr;
+	size_t off = 0;
+
+	for (int i = 0; i < RESP_LEN; i++) {
+		uint8_t c = i % 251;
+		evbuffer_add(local_in, &c, 1);
+	}
+
+	// what fits the window goes out, the tail stays with the local side
+	f->pc->stream.send_window = RESP_WINDOW;
+	tmux_stream_schedule(&f->pc->stream);
+	assert(take_data(f, WORK_ID, &off) == RESP_WINDOW);
+	assert(f->pc->stream.send_window == 0);
+	assert(evbuffer_get_length(local_in) == RESP_LEN - RESP_WINDOW);
+
+	// no local input arrives and no loop runs: the window update alone
+	// must flush the tail
+	tcp_mux_encode(WINDOW_UPDATE, ZERO, WORK_ID, WIN_DELTA, &hdr);
+	feed(f, (uint8_t *)&hdr, sizeof(hdr));
+	assert(take_data(f, WORK_ID, &off) == RESP_LEN - RESP_WINDOW);
+	assert(evbuffer_get_length(local_in) == 0);
+	assert(f->pc->stream.send_window == WIN_DELTA - (RESP_LEN - RESP_WINDOW));
+	assert(!f->pc->stream.sched_active);
+}
+
+// the window update frames in the session output, summed
+static uint32_t
+take_window_updates(struct fixture *f)
+{
+	struct evbuffer *out = bufferevent_get_output(f->session.bev);
+	uint32_t delta = 0;
+	while (evbuffer_get_length(out) >= sizeof(struct tcp_mux_header)) {
+		struct tcp_mux_header hdr;
+		evbuffer_remove(out, &hdr, sizeof(hdr));
+		assert(hdr.type == WINDOW_UPDATE);
+		assert(ntohl(hdr.stream_id) == WORK_ID);
+		delta += ntohl(hdr.length);
+	}
+	return delta;
+}
+
+static void
+test_window_inflight(struct fixture *f)
+{
+	static uint8_t plain[CRYPT_LEN];
+	struct crypto_stream *enc = new_crypto_stream(TOKEN, 1);
+	struct evbuffer *wire = evbuffer_new();
+	struct evbuffer *local = bufferevent_get_output(f->pc->local_proxy_bev);
+	struct tcp_mux_header hdr;
+
+	for (int i = 0; i < CRYPT_LEN; i++)
+		plain[i] = i % 251;
+	struct evbuffer *src = evbuffer_new();
+	evbuffer_add(src, plain, CRYPT_LEN);
+	evbuffer_add(wire, enc->iv, enc->iv_len);
+	crypto_stream_seal(enc, src, CRYPT_LEN, wire);
+	evbuffer_free(src);
+	size_t len = evbuffer_get_length(wire);
+	f->pc->dec = new_crypto_stream(TOKEN, 0);
+
+	// the record goes to a worker: no window comes back yet
+	tcp_mux_encode(DATA, ZERO, WORK_ID, len, &hdr);
+	feed(f, (uint8_t *)&hdr, sizeof(hdr));
+	feed(f, evbuffer_pullup(wire, len), len);
+	assert(f->pc->dec->inflight_bytes == len);
+	assert(evbuffer_get_length(local) == 0);
+	assert(take_window_updates(f) == 0);
+
+	// the worker hands it over, the local service still has to read it
+	while (f->pc->dec->inflight)
+		event_base_loop(base, EVLOOP_ONCE);
+	assert(f->pc->dec->inflight_bytes == 0);
+	assert(evbuffer_get_length(local) == CRYPT_LEN);
+	assert(memcmp(evbuffer_pullup(local, CRYPT_LEN), plain, CRYPT_LEN) == 0);
+	tmux_stream_drained(&f->pc->stream);
+	assert(take_window_updates(f) == 0);
+
+	// read: the window reopens
+	evbuffer_drain(local, CRYPT_LEN);
+	tmux_stream_drained(&f->pc->stream);
+	assert(take_window_updates(f) >= len);
+	assert(f->pc->stream.recv_window == f->pc->stream.max_recv_window);
+
+	free_crypto_stream(f->pc->dec);
+	f->pc->dec = NULL;
+	free_crypto_stream(enc);
+	evbuffer_free(wire);
+}
+
+int main(void)
+{
+	struct fixture f;
+	uint8_t *wire;
+	size_t len;
+
+	debugconf.debuglevel = LOG_ERR;
+	conf.tcp_mux = 1;
+	conf.tcp_mux_max_window = 4*1024*1024;
+	conf.auth_token = TOKEN;
+	base = event_base_new();
+	assert(base);
+	len = build_wire(&wire);
+
+	// whole
+	setup(&f);
+	feed(&f, wire, len);
+	check(&f);
+	teardown(&f);
+	printf("- test passed\n");
+
+	// two reads, cut at every byte
+	for (size_t cut = 1; cut < len; cut++) {
+		setup(&f);
+		feed(&f, wire, cut);
+		feed(&f, wire + cut, len - cut);
+		check(&f);
+		teardown(&f);
+	}
+	printf("- test passed\n");
+
+	// one byte per read
+	setup(&f);
+	for (size_t i = 0; i < len; i++)
+		feed(&f, wire + i, 1);
+	check(&f);
+	teardown(&f);
+	printf("- test passed\n");
+
+	// response tail beyond the window
+	setup(&f);
+	test_window_tail(&f);
+	teardown(&f);
+	printf("- test passed\n");
+
+	// encrypted data on a crypto worker
+	crypto_offload_init(base, 1);
+	setup(&f);
+	test_window_inflight(&f);
+	teardown(&f);
+	printf("- test passed\n");
+
+	crypto_offload_free();
+	free(wire);
+	event_base_free(base);
+	return 0;
+}
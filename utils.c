@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <ctype.h>
@@ -30,6 +31,14 @@ void s_sleep(unsigned int s, unsigned int u)
 	select(0, NULL, NULL, NULL, &timeout);
 }
 
+uint64_t get_monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 // is_valid_ip_address:
 // return 0:ipaddress unlegal
 int is_valid_ip_address(const char *ip_address) 
@@ -1,6 +1,8 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <stdint.h>
+
 struct mycurl_string {
 	char 	*ptr;
 	size_t 	len;
@@ -8,6 +10,10 @@ struct mycurl_string {
 
 void s_sleep(unsigned int s, unsigned int u);
 
+// get_monotonic_ms:
+// return milliseconds from a clock that never jumps with wall time
+uint64_t get_monotonic_ms();
+
 // is_valid_ip_address:
 // return 0:ipaddress unlegal
 int is_valid_ip_address(const char *ip_address);
@@ -48,7 +48,20 @@
 
 void xfrpc_loop()
 {
+	// crypto workers are only started when a proxy encrypts
+	struct common_conf *c_conf = get_common_config();
+	int encrypt = 0;
+	struct proxy_service *ps, *tmp;
+	HASH_ITER(hh, get_all_proxy_services(), ps, tmp) {
+		if (ps->use_encryption) {
+			encrypt = 1;
+			break;
+		}
+	}
+
 	init_main_control();
+	if (encrypt)
+		crypto_offload_init(get_main_control()->connect_base, c_conf->crypto_threads);
 	run_control();
 	
 	close_main_control();